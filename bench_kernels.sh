@@ -0,0 +1,38 @@
+#!/bin/sh
+# Match kernel crossover benchmark (see "Match Kernels" in COMPRESSION_METHOD.md)
+# Builds dictionaries of growing size and times every kernel with "repl2 b":
+#   words - word-boundary configs, keys sampled from the words of enwik_text2
+#   html  - configs without lookarounds, the first keys of htmlc.txt
+# usage: ./bench_kernels.sh [repl2] [inputs...]
+R=${1:-./repl2}
+[ $# -gt 0 ] && shift
+INPUTS=${*:-book1 enwik_text2}
+SIZES="1 2 4 8 16 32 64 256 1024 4096 16384"
+
+tr -cs 'a-zA-Z' '\n' < enwik_text2 | awk 'length >= 3' | sort | uniq -c | sort -rn | awk 'NR % 5 == 0 {print $2}' > bench_words.tmp
+
+for input in $INPUTS; do
+  for set in words html; do
+    echo "== $set on $input (ms per pass)"
+    printf "%6s %6s" keys bytes
+    for k in regex shiftand word dense packed; do printf " %9s" $k; done
+    echo "  auto"
+    for n in $SIZES; do
+      if [ $set = words ]; then
+        { echo '[^a-zA-Z]'; echo '[^a-zA-Z]'; head -n $n bench_words.tmp | awk '{print $0 "\t" toupper($0)}'; } > bench_dict.tmp
+      else
+        { echo '(?:)'; echo '(?:)'; tail -n +3 htmlc.txt | head -n $n; } > bench_dict.tmp
+      fi
+      [ $(grep -c . bench_dict.tmp) -lt $((n + 2)) ] && continue
+      $R b bench_dict.tmp $input 2>/dev/null | awk -v n=$n '
+        NR > 1 { t[$2] = $6; keys = $3; bytes = $4; if ($7 == "*") a = $2 }
+        END {
+          printf "%6s %6s", keys, bytes
+          split("regex shiftand word dense packed", ks, " ")
+          for (i = 1; i <= 5; i++) printf " %9s", (ks[i] in t) ? t[ks[i]] : "-"
+          printf "  %s\n", a
+        }'
+    done
+  done
+done
+rm -f bench_words.tmp bench_dict.tmp
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include "flag_api.h"
 
 #ifdef _WIN32
 #define DLLEXPORT __declspec(dllexport)
@@ -11,14 +12,14 @@
 #define DLLEXPORT __attribute__((visibility("default")))
 #endif
 
-// Context size constants for API
+// Context window requested from the host (see API_CONTEXT)
 static const int CTX_BEFORE = 32;  // symbols before match
 static const int CTX_AFTER = 32;   // symbols after match
 
 // Debug mode for API
 static const int API_DEBUG = 1;  // set to 0 to disable debug logging
 
-// API function for flags I/O
+// API function for flags I/O (see flag_api.h)
 // bit=-1: constructor, ctx=filename, ofs=mode (0=encode/write, 1=decode/read)
 // bit=-2: destructor
 // bit=-3: read flag (decode mode), returns 0/1 or -1 on EOF
@@ -26,6 +27,7 @@ static const int API_DEBUG = 1;  // set to 0 to disable debug logging
 static FILE* api_flg = nullptr;
 static FILE* api_dbg = nullptr;
 static int api_mode = 0;  // 0=encode, 1=decode
+static FlagFeatures api_feat;  // features of the next flag (API_FEATURES)
 
 static void api_log(int flag, int ofs, int len, int mlen, const char* ctx) {
   if (!api_dbg || !ctx) return;
@@ -33,6 +35,9 @@ static void api_log(int flag, int ofs, int len, int mlen, const char* ctx) {
   for (int i = 0; i < len; i++) {
     fprintf(api_dbg, "%02X", (unsigned char)ctx[i]);
   }
+  fprintf(api_dbg, " %d %d %llu %llu", api_feat.config, api_feat.pair, api_feat.pos, api_feat.doc);
+  for (int k = 0; k < FEATURE_WORDS; k++) fprintf(api_dbg, " %llx", api_feat.before[k]);
+  for (int k = 0; k < FEATURE_WORDS; k++) fprintf(api_dbg, " %llx", api_feat.after[k]);
   fprintf(api_dbg, "\n");
 }
 
@@ -82,3 +87,16 @@ extern "C" DLLEXPORT int API(char bit, const char* ctx, int ofs, int len, int ml
     return 0;
   }
 }
+
+// Context window: symbols before and after each match the host passes to
+// API(), 0 to 65536 each. Optional; without it the host passes 32 and 32.
+extern "C" DLLEXPORT int API_CONTEXT(int* before, int* after) {
+  *before = CTX_BEFORE;
+  *after = CTX_AFTER;
+  return 0;
+}
+
+// Features of the next flag, only logged here
+extern "C" DLLEXPORT void API_FEATURES(const FlagFeatures* f) {
+  api_feat = *f;
+}
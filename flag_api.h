@@ -0,0 +1,66 @@
+// Flag model ABI for repl2 (the DLL given on the command line, or one named
+// by a list line "config >module")
+//
+// The DLL exports one required function:
+//
+//   extern "C" int API(char bit, const char* ctx, int ofs, int len, int mlen);
+//
+// bit=-1: constructor, ctx=filename, ofs=mode (0=encode/write, 1=decode/read)
+// bit=-2: destructor
+// bit=-3: read flag (decode mode), returns 0/1 or -1 on EOF
+// bit>=0: write flag (encode mode)
+//
+// For flags, ctx[0, len) holds the match and the symbols around it, the
+// match starting at ctx[ofs] with mlen symbols (mlen=0 for header flags).
+//
+// Optional exports, looked up once after loading:
+//
+//   extern "C" int API_CONTEXT(int* before, int* after);
+//
+// sets the symbols before and after each match the model wants in ctx
+// (0..65536 each, 32/32 without it). Returns 0 on success.
+//
+//   extern "C" void API_FEATURES(const FlagFeatures* f);
+//
+// is called right before each flag write or read with the features of that
+// flag. The host computes them in one pass over each config's buffer, so
+// the model does not have to re-tokenize ctx. f is valid until API()
+// returns.
+//
+//   extern "C" long long API_SAVE(char* buf, long long cap);
+//   extern "C" int API_LOAD(const char* buf, long long len);
+//
+// snapshot and restore the model state. API_SAVE returns the snapshot size
+// and writes it to buf if it fits in cap bytes (buf may be null to ask for
+// the size), or -1 on error. API_LOAD replaces the state after API(-1) and
+// returns 0 on success; it should reject snapshots it did not write. repl2
+// saves after the last flag (-W) and loads right after API(-1) (-w), in
+// both modes, so a model can start from statistics trained on a reference
+// corpus.
+
+#ifndef FLAG_API_H
+#define FLAG_API_H
+
+// Words hashed on each side of a match
+enum { FEATURE_WORDS = 4 };
+
+struct FlagFeatures {
+  int config;                // config index in the list, in list order
+  int pair;                  // pair index of the match, -1 for header, segment and stage flags
+  unsigned long long pos;    // match position in the config's buffer
+  unsigned long long doc;    // position from the start of the document (%segment marker, else the buffer)
+  // Words are maximal runs of ASCII letters, digits and bytes >= 0x80.
+  // before[k] hashes the k + 1 nearest words ending at or before the
+  // match, after[k] the k + 1 nearest words starting at or after its end;
+  // 0 if there are fewer words. Stage flags get zeros.
+  unsigned long long before[FEATURE_WORDS];
+  unsigned long long after[FEATURE_WORDS];
+};
+
+typedef int (*API_func)(char bit, const char* ctx, int ofs, int len, int mlen);
+typedef int (*API_CONTEXT_func)(int* before, int* after);
+typedef void (*API_FEATURES_func)(const FlagFeatures* f);
+typedef long long (*API_SAVE_func)(char* buf, long long cap);
+typedef int (*API_LOAD_func)(const char* buf, long long len);
+
+#endif
@@ -0,0 +1,94 @@
+// Example flag model for repl2: packs flags 8 per byte without modeling
+// Meant for near-deterministic configs in a list, where a context model
+// costs CPU without saving bytes (see flag_api.h)
+// Compile on Linux: g++ -shared -fPIC -o pack.dll pack_dll.cpp
+// Compile on Windows: cl /LD pack_dll.cpp /Fe:pack.dll
+// List file usage: htmlc.txt >./pack.dll
+//
+// Flags file: the packed flags, low bit first, then one byte with the
+// number of flags in the last packed byte (0 if there are no flags)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "flag_api.h"
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT __attribute__((visibility("default")))
+#endif
+
+static FILE* api_flg = nullptr;
+static int api_mode = 0;            // 0=encode, 1=decode
+static unsigned char* api_buf = nullptr;  // decode: whole flags file
+static unsigned long long api_count = 0;  // flags written / flags in the file
+static unsigned long long api_next = 0;   // decode: next flag
+static int api_byte = 0;            // encode: flags of the pending byte
+
+// Contexts are not used, ask for none
+extern "C" DLLEXPORT int API_CONTEXT(int* before, int* after) {
+  *before = 0;
+  *after = 0;
+  return 0;
+}
+
+extern "C" DLLEXPORT int API(char bit, const char* ctx, int ofs, int len, int mlen) {
+  if (bit == -1) {
+    // Constructor: open flags file
+    api_mode = ofs;
+    api_count = api_next = 0;
+    api_byte = 0;
+    api_flg = fopen(ctx, api_mode == 0 ? "wb" : "rb");
+    if (!api_flg) {
+      fprintf(stderr, "Cannot open flags file %s\n", ctx);
+      return 1;
+    }
+    if (api_mode == 1) {
+      fseek(api_flg, 0, SEEK_END);
+      long size = ftell(api_flg);
+      fseek(api_flg, 0, SEEK_SET);
+      api_buf = (unsigned char*)malloc(size > 0 ? size : 1);
+      if (size < 1 || fread(api_buf, 1, size, api_flg) != (size_t)size || api_buf[size - 1] > 8 ||
+          (size == 1) != (api_buf[size - 1] == 0)) {
+        fprintf(stderr, "Bad packed flags file %s\n", ctx);
+        free(api_buf);
+        api_buf = nullptr;
+        fclose(api_flg);
+        api_flg = nullptr;
+        return 1;
+      }
+      api_count = size == 1 ? 0 : (unsigned long long)(size - 2) * 8 + api_buf[size - 1];
+    }
+    return 0;
+  }
+
+  if (bit == -2) {
+    // Destructor: flush the pending byte and the trailer
+    if (api_flg && api_mode == 0) {
+      if (api_count & 7) fputc(api_byte, api_flg);
+      fputc(api_count == 0 ? 0 : (int)((api_count - 1) & 7) + 1, api_flg);
+    }
+    if (api_flg) fclose(api_flg);
+    api_flg = nullptr;
+    free(api_buf);
+    api_buf = nullptr;
+    return 0;
+  }
+
+  if (bit == -3) {
+    // Read flag
+    if (api_next >= api_count) return -1;
+    int f = (api_buf[api_next >> 3] >> (api_next & 7)) & 1;
+    api_next++;
+    return f;
+  }
+
+  // Write flag
+  api_byte |= (bit & 1) << (api_count & 7);
+  api_count++;
+  if ((api_count & 7) == 0) {
+    fputc(api_byte, api_flg);
+    api_byte = 0;
+  }
+  return 0;
+}
@@ -0,0 +1,263 @@
+// Flag model for repl2: adaptive binary rANS with interleaved states
+// A small order-k model for configs that do not need a full context model
+// (see flag_api.h). Uses the host features, not the context bytes.
+// Compile on Linux: g++ -O2 -shared -fPIC -o rans.dll rans_dll.cpp
+// Compile on Windows: cl /O2 /LD rans_dll.cpp /Fe:rans.dll
+// Usage: repl2 c book1.cfg book1 book1.out book1.flg ./rans.dll
+//        or a list line "config_synonyms_size.txt >./rans.dll"
+//
+// Model: flags are split into buckets by config and pair index. Each bucket
+// keeps the last HIST_BITS flags it saw, and (bucket, history) selects an
+// adaptive probability, quantized to PROB_BITS for coding.
+//
+// Coder: flag i goes to state i % LANES. States are 32 bits and renormalize
+// by 16-bit words, at most once per flag, so one step is the same
+// straight-line code for every lane and a batch of LANES flags can run in
+// SIMD lanes. The encoder keeps (flag, probability) pairs and codes them in
+// reverse when the flags file is closed.
+//
+// Flags file: flag count (8 bytes), then 16-bit words: the LANES final
+// states (high word first), then the renormalization words in decode order.
+// All little endian.
+//
+// Snapshot (API_SAVE/API_LOAD): "rAN1", then p (2 bytes, little endian)
+// and n (1 byte) of every counter, then the bucket histories.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "flag_api.h"
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT __attribute__((visibility("default")))
+#endif
+
+static const int LANES = 8;
+static const int PROB_BITS = 12;
+static const uint32_t PROB_SCALE = 1u << PROB_BITS;
+static const uint32_t RANS_L = 1u << 16;  // lower bound of a normalized state
+static const int HIST_BITS = 6;
+static const int BUCKETS = 1024;
+static const int LIMIT = 30;  // adaptation count limit (rate 1/32 at most)
+
+struct Counter {
+  uint16_t p;  // probability of 1, 16 bits
+  uint8_t n;   // updates seen, up to LIMIT
+};
+
+static Counter model[BUCKETS << HIST_BITS];
+static uint8_t history[BUCKETS];
+static int rate[LIMIT + 1];  // 65536 / (n + 2): the update rate after n updates
+static FlagFeatures api_feat;  // features of the next flag (API_FEATURES)
+
+static FILE* api_flg = nullptr;
+static int api_mode = 0;  // 0=encode, 1=decode
+
+// Encode: (flag << 15 | probability) per flag, coded on close
+static uint16_t* enc_buf = nullptr;
+static size_t enc_count = 0, enc_cap = 0;
+
+// Decode: the whole file, lane states and the next word to read
+static uint16_t* dec_words = nullptr;
+static size_t dec_pos = 0, dec_end = 0;
+static uint64_t dec_count = 0, dec_next = 0;
+static uint32_t dec_state[LANES];
+
+static void model_reset() {
+  for (int i = 0; i < (BUCKETS << HIST_BITS); i++) model[i] = {32768, 0};
+  for (int n = 0; n <= LIMIT; n++) rate[n] = 65536 / (n + 2);
+  memset(history, 0, sizeof(history));
+  memset(&api_feat, 0, sizeof(api_feat));
+  api_feat.pair = -1;
+}
+
+// Counter of the next flag, from the features and the bucket history
+static Counter* model_slot(int mlen, uint32_t& bucket) {
+  uint32_t h = (uint32_t)api_feat.config * 0x9E3779B1u + (uint32_t)(api_feat.pair + 1) * 0x85EBCA77u + (mlen == 0);
+  bucket = (h ^ (h >> 15)) & (BUCKETS - 1);
+  return &model[(bucket << HIST_BITS) | history[bucket]];
+}
+
+// Coding probability of a 1, never 0 or PROB_SCALE
+static uint32_t quantize(const Counter* c) {
+  uint32_t p = c->p >> (16 - PROB_BITS);
+  return p < 1 ? 1 : p > PROB_SCALE - 1 ? PROB_SCALE - 1 : p;
+}
+
+static void model_update(Counter* c, uint32_t bucket, int bit) {
+  int target = bit ? 65535 : 0;
+  c->p += ((target - c->p) * rate[c->n]) >> 16;
+  if (c->n < LIMIT) c->n++;
+  history[bucket] = (uint8_t)(((history[bucket] << 1) | bit) & ((1 << HIST_BITS) - 1));
+}
+
+// Code all buffered flags, last flag first, and write the flags file
+static int encode_flush() {
+  uint32_t state[LANES];
+  for (int l = 0; l < LANES; l++) state[l] = RANS_L;
+
+  // Words come out in reverse decode order
+  uint16_t* words = (uint16_t*)malloc((enc_count + 2 * LANES) * sizeof(uint16_t));
+  if (!words) return 1;
+  size_t n = 0;
+  for (size_t i = enc_count; i-- > 0;) {
+    uint32_t& x = state[i % LANES];
+    int bit = enc_buf[i] >> 15;
+    uint32_t p1 = enc_buf[i] & 0x7FFF;
+    uint32_t freq = bit ? p1 : PROB_SCALE - p1;
+    uint32_t start = bit ? 0 : p1;
+    if (x >= ((RANS_L >> PROB_BITS) << 16) * freq) {
+      words[n++] = (uint16_t)x;
+      x >>= 16;
+    }
+    x = ((x / freq) << PROB_BITS) + x % freq + start;
+  }
+  for (int l = LANES; l-- > 0;) {
+    words[n++] = (uint16_t)state[l];
+    words[n++] = (uint16_t)(state[l] >> 16);
+  }
+
+  unsigned char head[8];
+  for (int b = 0; b < 8; b++) head[b] = (unsigned char)((uint64_t)enc_count >> (8 * b));
+  int err = fwrite(head, 1, 8, api_flg) != 8;
+  for (size_t k = n; k-- > 0 && !err;) {
+    unsigned char w[2] = {(unsigned char)words[k], (unsigned char)(words[k] >> 8)};
+    err = fwrite(w, 1, 2, api_flg) != 2;
+  }
+  free(words);
+  return err;
+}
+
+static int decode_open(const char* name) {
+  fseek(api_flg, 0, SEEK_END);
+  long size = ftell(api_flg);
+  fseek(api_flg, 0, SEEK_SET);
+  unsigned char* file = (unsigned char*)malloc(size > 0 ? size : 1);
+  if (size < 8 + 4 * LANES || (size & 1) || fread(file, 1, size, api_flg) != (size_t)size) {
+    fprintf(stderr, "Bad rANS flags file %s\n", name);
+    free(file);
+    return 1;
+  }
+  dec_count = 0;
+  for (int b = 0; b < 8; b++) dec_count |= (uint64_t)file[b] << (8 * b);
+  dec_end = (size - 8) / 2;
+  dec_words = (uint16_t*)malloc(dec_end * sizeof(uint16_t));
+  for (size_t k = 0; k < dec_end; k++) dec_words[k] = (uint16_t)(file[8 + 2 * k] | file[9 + 2 * k] << 8);
+  free(file);
+  for (int l = 0; l < LANES; l++) dec_state[l] = (uint32_t)dec_words[2 * l] << 16 | dec_words[2 * l + 1];
+  dec_pos = 2 * LANES;
+  dec_next = 0;
+  return 0;
+}
+
+extern "C" DLLEXPORT int API(char bit, const char* ctx, int ofs, int len, int mlen) {
+  if (bit == -1) {
+    // Constructor: open flags file
+    api_mode = ofs;
+    model_reset();
+    api_flg = fopen(ctx, api_mode == 0 ? "wb" : "rb");
+    if (!api_flg) {
+      fprintf(stderr, "Cannot open flags file %s\n", ctx);
+      return 1;
+    }
+    if (api_mode == 1 && decode_open(ctx) != 0) {
+      fclose(api_flg);
+      api_flg = nullptr;
+      return 1;
+    }
+    enc_count = 0;
+    return 0;
+  }
+
+  if (bit == -2) {
+    // Destructor: code the flags (encode), release buffers
+    int err = 0;
+    if (api_flg && api_mode == 0) err = encode_flush();
+    if (api_flg) fclose(api_flg);
+    api_flg = nullptr;
+    free(enc_buf);
+    enc_buf = nullptr;
+    enc_cap = enc_count = 0;
+    free(dec_words);
+    dec_words = nullptr;
+    if (err) fprintf(stderr, "Cannot write rANS flags file\n");
+    return err;
+  }
+
+  uint32_t bucket;
+  Counter* c = model_slot(mlen, bucket);
+  uint32_t p1 = quantize(c);
+
+  if (bit == -3) {
+    // Read flag
+    if (!dec_words || dec_next >= dec_count) return -1;
+    uint32_t& x = dec_state[dec_next++ % LANES];
+    uint32_t m = x & (PROB_SCALE - 1);
+    int f = m < p1;
+    x = (f ? p1 : PROB_SCALE - p1) * (x >> PROB_BITS) + m - (f ? 0 : p1);
+    if (x < RANS_L) {
+      if (dec_pos >= dec_end) return -1;
+      x = x << 16 | dec_words[dec_pos++];
+    }
+    model_update(c, bucket, f);
+    return f;
+  }
+
+  // Write flag
+  if (!api_flg) return -1;
+  if (enc_count == enc_cap) {
+    enc_cap = enc_cap ? 2 * enc_cap : 1 << 16;
+    uint16_t* grown = (uint16_t*)realloc(enc_buf, enc_cap * sizeof(uint16_t));
+    if (!grown) return -1;
+    enc_buf = grown;
+  }
+  int f = bit ? 1 : 0;
+  enc_buf[enc_count++] = (uint16_t)(f << 15 | p1);
+  model_update(c, bucket, f);
+  return 0;
+}
+
+// The model reads no context bytes
+extern "C" DLLEXPORT int API_CONTEXT(int* before, int* after) {
+  *before = 0;
+  *after = 0;
+  return 0;
+}
+
+extern "C" DLLEXPORT void API_FEATURES(const FlagFeatures* f) {
+  api_feat = *f;
+}
+
+static const char SNAPSHOT_TAG[4] = {'r', 'A', 'N', '1'};
+static const long long SNAPSHOT_SIZE = 4 + 3LL * (BUCKETS << HIST_BITS) + BUCKETS;
+
+extern "C" DLLEXPORT long long API_SAVE(char* buf, long long cap) {
+  if (!buf || cap < SNAPSHOT_SIZE) return SNAPSHOT_SIZE;
+  memcpy(buf, SNAPSHOT_TAG, 4);
+  char* out = buf + 4;
+  for (int i = 0; i < (BUCKETS << HIST_BITS); i++) {
+    *out++ = (char)model[i].p;
+    *out++ = (char)(model[i].p >> 8);
+    *out++ = (char)model[i].n;
+  }
+  memcpy(out, history, BUCKETS);
+  return SNAPSHOT_SIZE;
+}
+
+extern "C" DLLEXPORT int API_LOAD(const char* buf, long long len) {
+  if (len != SNAPSHOT_SIZE || memcmp(buf, SNAPSHOT_TAG, 4) != 0) return 1;
+  const unsigned char* in = (const unsigned char*)buf + 4;
+  for (int i = 0; i < (BUCKETS << HIST_BITS); i++, in += 3) {
+    if (in[2] > LIMIT) return 1;
+    model[i].p = (uint16_t)(in[0] | in[1] << 8);
+    model[i].n = in[2];
+  }
+  for (int b = 0; b < BUCKETS; b++) {
+    if (in[b] >= (1 << HIST_BITS)) return 1;
+  }
+  memcpy(history, in, BUCKETS);
+  return 0;
+}
@@ -5,15 +5,45 @@
 
 #define byte byte1
 #include <pcre2.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <deque>
+#include <cmath>
+#include <thread>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#ifndef S_ISDIR
+#define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+#endif
+#else
+#include <unistd.h>
+#endif
+#include "stage_api.h"
+#include "flag_api.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#define HAVE_SSE42
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #undef byte
 
 //#define pcre2_jit_compile(x,y) 0
@@ -35,21 +65,80 @@ typedef unsigned int uint;
 typedef unsigned short word;
 typedef unsigned char byte;
 
-// Context size constants for API
-static const int CTX_BEFORE = 32;  // symbols before match
-static const int CTX_AFTER = 32;   // symbols after match
+// Index of the lowest set bit (x != 0)
+static inline int ctz64(qword x) {
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward64(&i, x);
+  return i;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
 
-// API function pointer type
-// bit=-1: constructor, ctx=filename, ofs=mode (0=encode/write, 1=decode/read)
-// bit=-2: destructor
-// bit=-3: read flag (decode mode), returns 0/1 or -1 on EOF
-// bit>=0: write flag (encode mode)
-typedef int (*API_func)(char bit, const char* ctx, int ofs, int len, int mlen);
+// Context window passed to the API with each flag, 32/32 unless the DLL
+// asks for its own (API_CONTEXT, see flag_api.h)
+static const int MAX_CONTEXT = 1 << 16;
+static int context_before = 32;  // symbols before match
+static int context_after = 32;   // symbols after match
 
-// Global API function pointer (loaded from DLL)
+// Global API function pointers (loaded from DLL, see flag_api.h)
 static API_func API = nullptr;
+static API_FEATURES_func API_FEATURES = nullptr;  // optional
+static int feature_config = 0;  // config whose flags are read (FlagFeatures.config)
+
+// Flag model DLLs: model 0 is the one from the command line, list lines
+// "config >module" add more. Each model codes its own segment of the flags
+// file; use_model() points the globals above at the model of a config.
+struct FlagModel {
+  string name;
+  void* handle = nullptr;
+  API_func api = nullptr;
+  API_FEATURES_func features = nullptr;
+  API_SAVE_func save = nullptr;  // optional, with load
+  API_LOAD_func load = nullptr;
+  int before = 32, after = 32;
+  qword digest = 0;  // module_digest
+};
+static vector<FlagModel> flag_models;
+
+static void use_model(int k) {
+  const FlagModel& m = flag_models[k];
+  API = m.api;
+  API_FEATURES = m.features;
+  context_before = m.before;
+  context_after = m.after;
+}
+
+// No per-config reports (set for the blocks after the first of a container)
+static bool quiet = false;
+
+// Engine errors end the tool with exit code 1. Serve and batch jobs set
+// fail_throws, so that an error ends only the job: fail() then throws an
+// EngineError with the message, and the job replies with it.
+struct EngineError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+static bool fail_throws = false;
+static void (*fail_cleanup)() = nullptr;  // removes the run's temporary files before exit
+
+// Report an engine error and stop (see EngineError)
+[[noreturn]] static void fail(const char* format, ...) {
+  char msg[1024];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(msg, sizeof(msg), format, args);
+  va_end(args);
+  if (fail_throws) throw EngineError(msg);  // reported with the job
+  fprintf(stderr, "%s\n", msg);
+  if (fail_cleanup) fail_cleanup();  // exit() skips the destructors
+  exit(1);
+}
 
+static int load_model(const char* dll_name);
 static bool load_dll(const char* dll_name);
+static STAGE_func load_stage(const char* stage_name);
+static qword module_digest(const void* symbol);
 static void unload_dll();
 
 // Structure to hold a single flag record for caching
@@ -59,21 +148,42 @@ struct FlagRecord {
   int ctx_ofs;    // offset within context
   int ctx_len;    // context length
   int match_len;  // match length
+  size_t pos = 0;  // match position (segment mode)
+  size_t pair = SIZE_MAX;  // pair that restores the match (implied pairs)
+  FlagFeatures features = {0, -1};  // if the DLL takes them
 };
 
 struct ReplacementPair {
   string from;
   string to;
+  bool fold = false;  // case template: also covers Capitalized and UPPER variants
 };
 
+struct PrebuiltMatchers;
+
 // Structure to hold a parsed config
 struct ParsedConfig {
   string name;  // config file name (for logging)
   string lb;    // lookbehind pattern
   string la;    // lookahead pattern
   vector<ReplacementPair> pairs;
+  string segment;                 // segment marker (%segment), empty if none
+  string stage;                   // transform stage module ("!module" list entry)
+  string stage_arg;               // argument passed to STAGE_INIT
+  STAGE_func stage_fn = nullptr;  // loaded stage entry point
+  qword stage_digest = 0;         // module_digest of the stage
+  string model_name;              // flag model DLL ("config >module"), empty for the default
+  int model = 0;                  // index in flag_models
+  shared_ptr<PrebuiltMatchers> prebuilt;  // see prebuild_matchers, null if none
 };
 
+static bool load_list_models(vector<ParsedConfig>& configs);
+static bool open_config_flags(const ParsedConfig& cfg, size_t i, int mode);
+static void close_config_flags(size_t i, int mode);
+
+// Chunk size for feeding transform stages
+static const size_t STAGE_CHUNK = 1 << 20;
+
 void decode_escapes(string &s) {
   string result;
   size_t i, len;
@@ -120,10 +230,7 @@ string read_file(const char *path) {
   string result;
 
   f = fopen(path, "rb");
-  if (!f) {
-    fprintf(stderr, "Cannot open %s\n", path);
-    exit(1);
-  }
+  if (!f) fail("Cannot open %s", path);
 
   fseeko64(f, 0, SEEK_END);
   size = ftello64(f);
@@ -131,8 +238,8 @@ string read_file(const char *path) {
 
   buffer = (char *)malloc(size + 1);
   if (!buffer) {
-    fprintf(stderr, "Memory allocation failed\n");
-    exit(1);
+    fclose(f);
+    fail("Memory allocation failed");
   }
 
   fread(buffer, 1, size, f);
@@ -144,8 +251,115 @@ string read_file(const char *path) {
   return result;
 }
 
+// Write a whole file, reports failures
+static bool write_file(const char* path, const string& data) {
+  FILE* f = fopen(path, "wb");
+  bool ok = f && fwrite(data.data(), 1, data.length(), f) == data.length();
+  if (f && fclose(f) != 0) ok = false;
+  if (!ok) fprintf(stderr, "Cannot write %s\n", path);
+  return ok;
+}
+
+// Create a directory if it does not exist yet
+static void make_dir(const char* path) {
+#ifdef _WIN32
+  _mkdir(path);
+#else
+  mkdir(path, 0777);
+#endif
+}
+
+// Create an empty file with a unique name in the temp directory ($TMPDIR or
+// /tmp, %TMP% on Windows) and return its path, "" on failure
+static string temp_file(const char* prefix) {
+#ifdef _WIN32
+  char* name = _tempnam(nullptr, prefix);
+  string path = name ? name : "";
+  free(name);
+  FILE* f = path.empty() ? nullptr : fopen(path.c_str(), "wb");
+  if (!f) return "";
+  fclose(f);
+#else
+  const char* dir = getenv("TMPDIR");
+  string path = string(dir && *dir ? dir : "/tmp") + "/" + prefix + "XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0) return "";
+  close(fd);
+#endif
+  return path;
+}
+
+// Little-endian 8-byte fields of the flags, snapshot and container files
+static void put_u64(string& s, qword v) {
+  for (int b = 0; b < 8; b++) s += (char)(v >> (8 * b));
+}
+
+static qword get_u64(const char* p) {
+  qword v = 0;
+  for (int b = 0; b < 8; b++) v |= (qword)(byte)p[b] << (8 * b);
+  return v;
+}
+
+// CRC32C (Castagnoli), continuing from crc (0 to start). Uses the SSE4.2
+// instruction when the build enables it, else slicing by 8.
+static uint crc32c(uint crc, const char* data, size_t len) {
+  const byte* p = (const byte*)data;
+  crc = ~crc;
+#ifdef HAVE_SSE42
+  qword c = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    qword v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = (uint)c;
+  for (; len > 0; p++, len--) crc = _mm_crc32_u8(crc, *p);
+#else
+  static uint table[8][256];
+  static bool ready = false;
+  if (!ready) {
+    for (uint i = 0; i < 256; i++) {
+      uint c = i;
+      for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+      table[0][i] = c;
+    }
+    for (uint i = 0; i < 256; i++) {
+      for (int t = 1; t < 8; t++) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+    }
+    ready = true;
+  }
+  for (; len >= 8; p += 8, len -= 8) {
+    uint lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24);
+    crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+          table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+  }
+  for (; len > 0; p++, len--) crc = table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+#endif
+  return ~crc;
+}
+
+// 64-bit hash for cache keys, 8 bytes per step (not cryptographic; cache
+// entries also carry the length and CRC32C of what they hold)
+static qword hash64(const char* data, size_t len, qword seed = 0) {
+  qword h = seed ^ (len * 0x9E3779B97F4A7C15ULL);
+  size_t k = 0;
+  for (; k + 8 <= len; k += 8) {
+    qword w;
+    memcpy(&w, data + k, 8);
+    h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 32;
+  }
+  qword w = 0;
+  memcpy(&w, data + k, len - k);
+  h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 29;
+  h *= 0xFF51AFD7ED558CCDULL;
+  return h ^ (h >> 32);
+}
+
 // Parse config from string data
-void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector<ReplacementPair> &pairs) {
+void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector<ReplacementPair> &pairs,
+                       string &segment) {
   string cfg_data = cfg_data_in;
   size_t pos, line_start, line_end;
   int line_num;
@@ -159,6 +373,7 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
   // Parse lines
   line_num = 0;
   line_start = 0;
+  bool fold = false;  // %case directive seen
 
   while (line_start < cfg_data.length()) {
     line_end = cfg_data.find('\n', line_start);
@@ -172,12 +387,18 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
       lb = line;
     } else if (line_num == 1) {
       la = line;
+    } else if (line == "%case" || line == "%exact") {
+      fold = (line == "%case");
+    } else if (line.compare(0, 9, "%segment ") == 0) {
+      segment = line.substr(9);
+      decode_escapes(segment);
     } else if (!line.empty() && line.find('\t') != string::npos) {
       size_t tab_pos;
       tab_pos = line.find('\t');
       ReplacementPair pair;
       pair.from = line.substr(0, tab_pos);
       pair.to = line.substr(tab_pos + 1);
+      pair.fold = fold;
       decode_escapes(pair.from);
       decode_escapes(pair.to);
       pairs.push_back(pair);
@@ -189,9 +410,9 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
 }
 
 // Parse config from file (wrapper that reads file then parses)
-void parse_config(const char *cfg_file, string &lb, string &la, vector<ReplacementPair> &pairs) {
+void parse_config(const char *cfg_file, string &lb, string &la, vector<ReplacementPair> &pairs, string &segment) {
   string cfg_data = read_file(cfg_file);
-  parse_config_data(cfg_data, lb, la, pairs);
+  parse_config_data(cfg_data, lb, la, pairs, segment);
 }
 
 // Parse a list file and load all configs into memory
@@ -235,11 +456,32 @@ vector<ParsedConfig> parse_list_file(const char* list_path) {
   }
 
   // Load and parse each config file
-  for (const string& path : config_paths) {
+  for (string path : config_paths) {
     ParsedConfig cfg;
+    // Flag model of the entry: "config >module"
+    size_t gt = path.rfind(" >");
+    if (gt != string::npos) {
+      cfg.model_name = path.substr(gt + 2);
+      path.erase(gt);
+      while (!path.empty() && (path.back() == ' ' || path.back() == '\t')) path.pop_back();
+      if (cfg.model_name.empty() || path.empty()) {
+        fail("Bad list line in %s: %s >%s", list_path, path.c_str(), cfg.model_name.c_str());
+      }
+    }
     cfg.name = path;
+    if (path[0] == '!') {
+      // Transform stage module: "!module [arg]"
+      size_t sp = path.find(' ');
+      cfg.stage = path.substr(1, sp == string::npos ? string::npos : sp - 1);
+      if (sp != string::npos) cfg.stage_arg = path.substr(sp + 1);
+      cfg.stage_fn = load_stage(cfg.stage.c_str());
+      if (!cfg.stage_fn) fail("Cannot use stage %s", cfg.stage.c_str());
+      cfg.stage_digest = module_digest((const void*)cfg.stage_fn);
+      configs.push_back(std::move(cfg));
+      continue;
+    }
     string cfg_data = read_file(path.c_str());
-    parse_config_data(cfg_data, cfg.lb, cfg.la, cfg.pairs);
+    parse_config_data(cfg_data, cfg.lb, cfg.la, cfg.pairs, cfg.segment);
     configs.push_back(std::move(cfg));
   }
 
@@ -265,6 +507,7 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
   current.name = base_name;
   int config_index = 0;
   bool in_pairs = false;  // Track if we've started reading pairs
+  bool fold = false;      // %case directive seen
 
   // Parse lines
   line_num = 0;
@@ -293,13 +536,20 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
           current.name = base_name + "[" + to_string(config_index) + "]";
           line_num = -1;  // Reset for next config (will be incremented to 0)
           in_pairs = false;
+          fold = false;
         }
+      } else if (line == "%case" || line == "%exact") {
+        fold = (line == "%case");
+      } else if (line.compare(0, 9, "%segment ") == 0) {
+        current.segment = line.substr(9);
+        decode_escapes(current.segment);
       } else if (line.find('\t') != string::npos) {
         size_t tab_pos;
         tab_pos = line.find('\t');
         ReplacementPair pair;
         pair.from = line.substr(0, tab_pos);
         pair.to = line.substr(tab_pos + 1);
+        pair.fold = fold;
         decode_escapes(pair.from);
         decode_escapes(pair.to);
         current.pairs.push_back(pair);
@@ -339,14 +589,17 @@ string regex_quote(string_view s) {
   return result;
 }
 
-string build_alternation(const vector<string_view> &keys) {
-  vector<pair<size_t, string_view>> sorted;
+string build_alternation(const vector<string_view> &keys, const vector<string_view> &fold_keys = {}) {
+  vector<pair<size_t, pair<string_view, bool>>> sorted;
   string result;
   size_t i;
 
-  sorted.reserve(keys.size());
+  sorted.reserve(keys.size() + fold_keys.size());
   for (i = 0; i < keys.size(); i++) {
-    sorted.push_back(make_pair(keys[i].length(), keys[i]));
+    sorted.push_back(make_pair(keys[i].length(), make_pair(keys[i], false)));
+  }
+  for (i = 0; i < fold_keys.size(); i++) {
+    sorted.push_back(make_pair(fold_keys[i].length(), make_pair(fold_keys[i], true)));
   }
 
   // Sort by length descending using std::sort (O(n log n) instead of O(n^2))
@@ -357,414 +610,4131 @@ string build_alternation(const vector<string_view> &keys) {
   for (i = 0; i < sorted.size(); i++) {
     if (i > 0)
       result += '|';
-    result += regex_quote(sorted[i].second);
+    if (sorted[i].second.second) {
+      // Case template: one caseless alternative covers all variants
+      result += "(?i:" + regex_quote(sorted[i].second.first) + ")";
+    } else {
+      result += regex_quote(sorted[i].second.first);
+    }
   }
 
   return result;
 }
 
-// Compress with a single config - works on in-memory data
-// Returns flags in flags_out, modifies data in-place
-void compress_single(const ParsedConfig& cfg, const string& original, string& intermediate,
-                     vector<FlagRecord>& flags_out) {
-  const string& lb = cfg.lb;
-  const string& la = cfg.la;
-  const vector<ReplacementPair>& pairs = cfg.pairs;
-  unordered_map<string_view, string_view> forward, backward;
-  vector<string_view> forward_keys, backward_keys;
-  pcre2_code *fwd_re;
-  pcre2_code *bwd_re;
-  pcre2_match_data *match_data;
-  int rc;
-  PCRE2_SIZE *ovector;
-  PCRE2_SIZE offset;
-  string fwd_pattern, bwd_pattern;
-  size_t i;
+// Case variants of a template pair: 0=as declared, 1=Capitalized, 2=UPPER
+// Capitalized uppercases the first letter ('cause -> 'Cause)
+string case_variant(string_view s, int cls) {
+  string result(s);
+  bool first = true;
+  for (size_t i = 0; i < result.length(); i++) {
+    if (result[i] >= 'a' && result[i] <= 'z' && (cls == 2 || (cls == 1 && first))) result[i] -= 32;
+    if ((result[i] >= 'a' && result[i] <= 'z') || (result[i] >= 'A' && result[i] <= 'Z')) first = false;
+  }
+  return result;
+}
 
-  pcre2_config(PCRE2_CONFIG_JIT, &rc);
-  //printf( "!JIT=%i!\n", rc );
+string ascii_lower(string_view s) {
+  string result(s);
+  for (size_t i = 0; i < result.length(); i++) {
+    if (result[i] >= 'A' && result[i] <= 'Z') result[i] += 32;
+  }
+  return result;
+}
 
-  if (pairs.empty()) {
-    fprintf(stderr, "No replacement pairs found in config %s\n", cfg.name.c_str());
-    exit(1);
+// Check whether text equals case variant cls of key
+static bool is_case_variant(string_view text, string_view key, int cls) {
+  if (text.length() != key.length()) return false;
+  bool first = true;
+  for (size_t i = 0; i < key.length(); i++) {
+    char c = key[i];
+    bool letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    if (c >= 'a' && c <= 'z' && (cls == 2 || (cls == 1 && first))) c -= 32;
+    if (letter) first = false;
+    if (text[i] != c) return false;
   }
+  return true;
+}
 
-  // Reserve space for vectors
-  forward_keys.reserve(pairs.size());
-  backward_keys.reserve(pairs.size());
+// Template pair stored once under its lowercased key
+struct FoldEntry {
+  string_view key;    // declared form
+  string_view value;
+  size_t index;       // pair index
+};
 
-  // Build forward and backward maps (using string_view references to pairs)
-  for (i = 0; i < pairs.size(); i++) {
-    string_view from_view(pairs[i].from);
-    string_view to_view(pairs[i].to);
-    forward[from_view] = to_view;
-    forward_keys.push_back(from_view);
+// Replacement lookup for one direction of a config
+// Duplicate keys resolve like the spelled-out pair list: the forward map
+// keeps the last pair for a key, the backward map the first one.
+// Template pairs count as three consecutive pairs (declared, Capitalized, UPPER).
+struct PairMap {
+  bool first_wins = false;
+  unordered_map<string_view, pair<string_view, size_t>> exact;
+  unordered_map<string, vector<FoldEntry>> folded;
+  vector<string_view> keys;       // explicit keys for the pattern
+  vector<string_view> fold_keys;  // one template key per lowercased form
+};
 
-    if (backward.find(to_view) == backward.end()) {
-      backward[to_view] = from_view;
-      backward_keys.push_back(to_view);
-    }
-  }
+void build_pair_map(const vector<ReplacementPair>& pairs, bool backward, PairMap& m) {
+  m.first_wins = backward;
+  m.keys.reserve(pairs.size());
 
-  // Reserve space for intermediate output
-  intermediate.clear();
-  intermediate.reserve(original.length());
+  for (size_t i = 0; i < pairs.size(); i++) {
+    string_view key(backward ? pairs[i].to : pairs[i].from);
+    string_view value(backward ? pairs[i].from : pairs[i].to);
 
-  // Build forward regex pattern
-  fwd_pattern = "(?<=" + lb + ")(" + build_alternation(forward_keys) + ")(?=" + la + ")";
+    if (pairs[i].fold) {
+      vector<FoldEntry>& group = m.folded[ascii_lower(key)];
+      if (group.empty()) m.fold_keys.push_back(key);
+      group.push_back({key, value, i});
+      continue;
+    }
 
-  // Compile forward regex
-  int errcode=-1;
+    auto it = m.exact.find(key);
+    if (it == m.exact.end()) {
+      m.exact[key] = make_pair(value, i);
+      m.keys.push_back(key);
+    } else if (!backward) {
+      it->second = make_pair(value, i);
+    }
+  }
+}
 
-  pcre2_config(PCRE2_CONFIG_JIT, &errcode);
+// Look up the replacement for matched text
+// Template values are built in scratch; returns false for case variants that
+// no pair declares (e.g. "cOLOUR" matched by a caseless template)
+// If pair is given, it receives the index of the pair that was used
+bool pair_lookup(const PairMap& m, string_view text, string_view& repl, string& scratch, size_t* pair = nullptr) {
+  bool found = false;
+  size_t best = 0;  // precedence: pair index * 3 + case variant
+
+  auto it = m.exact.find(text);
+  if (it != m.exact.end()) {
+    repl = it->second.first;
+    best = it->second.second * 3;
+    found = true;
+  }
 
-  PCRE2_SIZE erroffset;
-  fwd_re = pcre2_compile((PCRE2_SPTR)fwd_pattern.c_str(), PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
-  pcre2_jit_compile(fwd_re, PCRE2_JIT_COMPLETE);
+  auto ft = m.folded.empty() ? m.folded.end() : m.folded.find(ascii_lower(text));
+  if (ft != m.folded.end()) {
+    for (const FoldEntry& e : ft->second) {
+      for (int k = 0; k < 3; k++) {
+        int cls = m.first_wins ? k : 2 - k;
+        if (!is_case_variant(text, e.key, cls)) continue;
+        size_t prec = e.index * 3 + cls;
+        if (!found || (m.first_wins ? prec < best : prec > best)) {
+          scratch = case_variant(e.value, cls);
+          repl = scratch;
+          best = prec;
+          found = true;
+        }
+        break;
+      }
+    }
+  }
+  if (found && pair) *pair = best / 3;
+  return found;
+}
 
-  if (!fwd_re) {
-    fprintf(stderr, "PCRE2 compilation failed\n");
-    exit(1);
+// Word-token engine for configs whose lb and la are the same negated
+// character class, e.g. [^a-zA-Z]. Such a config can only match whole
+// words or word sequences, so matching walks word spans of the buffer and
+// probes a hash table with each word (or n-gram, for keys like "do not").
+
+// Parse a simple negated class "[^a-zA-Z']" into a word character table
+// Returns false for anything else (escapes other than \x, POSIX classes...)
+static bool parse_word_class(const string& cls, bool word[256]) {
+  if (cls.length() < 4 || cls[0] != '[' || cls[1] != '^' || cls.back() != ']') return false;
+  memset(word, 0, 256);
+  size_t i = 2, n = cls.length() - 1;
+  if (i == n) return false;
+  while (i < n) {
+    unsigned char c = cls[i++];
+    if (c == '[' || c == ']' || c == '^') return false;
+    if (c == '\\') {
+      if (i >= n) return false;
+      c = cls[i++];
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return false;
+    }
+    if (i + 1 < n && cls[i] == '-') {
+      unsigned char hi = cls[i + 1];
+      if (hi == '\\' || hi == '[' || hi < c) return false;
+      for (int k = c; k <= hi; k++) word[k] = true;
+      i += 2;
+    } else {
+      word[c] = true;
+    }
   }
+  return true;
+}
 
-  match_data = pcre2_match_data_create_from_pattern(fwd_re, NULL);
+// Word bitmap of a buffer: bit i is set when byte i is a word character
+// Kept in a small cache so consecutive word-boundary configs share it;
+// token_index_release() must be called before a cached buffer changes.
+// Each scan thread has its own cache.
+struct TokenIndex {
+  const char* ptr;
+  size_t len;
+  bool word[256];
+  vector<uint64_t> bits;
+};
 
-  // Forward replacement with position tracking
-  offset = 0;
-  qword last_end;
-  last_end = 0;
+static thread_local vector<TokenIndex*> token_cache;
 
-  while (offset < original.length()) {
-    rc = pcre2_jit_match(fwd_re, (PCRE2_SPTR)original.c_str(), original.length(), offset, 0, match_data, NULL);
+static const TokenIndex& token_index_get(string_view s, const bool word[256]) {
+  for (TokenIndex* ti : token_cache) {
+    if (ti->ptr == s.data() && ti->len == s.length() && !memcmp(ti->word, word, 256)) return *ti;
+  }
 
-    if (rc < 0)
-      break;
+  TokenIndex* ti = new TokenIndex;
+  ti->ptr = s.data();
+  ti->len = s.length();
+  memcpy(ti->word, word, 256);
+  ti->bits.assign(s.length() / 64 + 1, 0);
+
+  const byte* p = (const byte*)s.data();
+  for (size_t w = 0; w < s.length() / 64; w++, p += 64) {
+    uint64_t b = 0;
+    for (int k = 0; k < 64; k++) b |= (uint64_t)word[p[k]] << k;
+    ti->bits[w] = b;
+  }
+  for (size_t i = s.length() & ~(size_t)63; i < s.length(); i++) {
+    ti->bits[i >> 6] |= (uint64_t)word[(byte)s[i]] << (i & 63);
+  }
 
-    ovector = pcre2_get_ovector_pointer(match_data);
-    PCRE2_SIZE start, end;
-    start = ovector[0];
-    end = ovector[1];
+  token_cache.push_back(ti);
+  return *ti;
+}
 
-    // Add unmatched portion
-    if (start > last_end) {
-      intermediate.append(original.data() + last_end, start - last_end);
+// Drop cached indexes of a buffer that is about to be modified or freed
+void token_index_release(string_view s) {
+  for (size_t i = 0; i < token_cache.size(); i++) {
+    if (token_cache[i]->ptr == s.data()) {
+      delete token_cache[i];
+      token_cache.erase(token_cache.begin() + i);
+      i--;
     }
+  }
+}
 
-    // Add replacement
-    string_view match_str(original.data() + start, end - start);
-    string_view repl = forward[match_str];
-    intermediate.append(repl.data(), repl.length());
-
-    last_end = end;
-    offset = end;
-    if (offset == start)
-      offset++;
+// First word start at or after p (a word byte preceded by a non-word byte)
+static size_t next_word_start(const TokenIndex& ti, size_t p) {
+  if (p >= ti.len) return ti.len;
+  size_t w = p >> 6;
+  uint64_t prev = w ? ti.bits[w - 1] >> 63 : 1;  // position 0 has no lookbehind
+  uint64_t starts = ti.bits[w] & ~((ti.bits[w] << 1) | prev);
+  starts &= ~(uint64_t)0 << (p & 63);
+  while (!starts) {
+    if (++w >= ti.bits.size()) return ti.len;
+    starts = ti.bits[w] & ~((ti.bits[w] << 1) | (ti.bits[w - 1] >> 63));
   }
+  size_t q = (w << 6) + ctz64(starts);
+  return q < ti.len ? q : ti.len;
+}
 
-  // Add remaining portion
-  if (last_end < original.length()) {
-    intermediate.append(original.data() + last_end, original.length() - last_end);
+// First non-word byte at or after p
+static size_t next_word_end(const TokenIndex& ti, size_t p) {
+  if (p >= ti.len) return ti.len;
+  size_t w = p >> 6;
+  uint64_t ends = ~ti.bits[w] & (~(uint64_t)0 << (p & 63));
+  while (!ends) {
+    if (++w >= ti.bits.size()) return ti.len;
+    ends = ~ti.bits[w];
   }
+  size_t q = (w << 6) + ctz64(ends);
+  return q < ti.len ? q : ti.len;
+}
 
-  pcre2_match_data_free(match_data);
-  pcre2_code_free(fwd_re);
+static const uint64_t WORD_HASH_MUL = 0x9E3779B97F4A7C15ULL;
 
-  // Build backward regex pattern
-  bwd_pattern = "(?<=" + lb + ")(" + build_alternation(backward_keys) + ")(?=" + la + ")";
+static inline uint64_t word_hash_step(uint64_t h, byte c) {
+  return (h + c + 1) * WORD_HASH_MUL;
+}
 
-  bwd_re = pcre2_compile((PCRE2_SPTR)bwd_pattern.c_str(), PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
-  pcre2_jit_compile(bwd_re, PCRE2_JIT_COMPLETE);
+static inline byte fold_byte(byte c) {
+  return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
 
-  if (!bwd_re) {
-    fprintf(stderr, "PCRE2 compilation failed\n");
-    exit(1);
+// Flat open-addressing table of keys (exact keys, or lowercased templates)
+struct WordTable {
+  struct Slot {
+    uint64_t hash;
+    string_view key;
+  };
+  vector<Slot> slots;  // empty slot: key.data() == nullptr
+  uint64_t mask = 0;
+
+  void build(const vector<string_view>& keys) {
+    size_t size = 16;
+    while (size < keys.size() * 2) size <<= 1;
+    slots.assign(size, Slot{0, string_view()});
+    mask = size - 1;
+    for (string_view k : keys) {
+      uint64_t h = 0;
+      for (char c : k) h = word_hash_step(h, (byte)c);
+      size_t i = (h >> 32) & mask;
+      while (slots[i].key.data()) i = (i + 1) & mask;
+      slots[i].hash = h;
+      slots[i].key = k;
+    }
   }
 
-  match_data = pcre2_match_data_create_from_pattern(bwd_re, NULL);
-
-  // Pass 1: Collect all matches in intermediate
-  vector<pair<PCRE2_SIZE, PCRE2_SIZE>> matches;
-  matches.reserve(intermediate.length() / 4);
-  offset = 0;
-
-  while (offset < intermediate.length()) {
-    rc = pcre2_jit_match(bwd_re, (PCRE2_SPTR)intermediate.c_str(), intermediate.length(), offset, 0, match_data, NULL);
-    if (rc < 0) break;
-
-    ovector = pcre2_get_ovector_pointer(match_data);
-    PCRE2_SIZE start = ovector[0];
-    PCRE2_SIZE end = ovector[1];
-    matches.push_back({start, end});
-    offset = start + 1;
+  bool find(uint64_t h, const char* text, size_t len, bool fold) const {
+    if (slots.empty()) return false;
+    for (size_t i = (h >> 32) & mask; slots[i].key.data(); i = (i + 1) & mask) {
+      if (slots[i].hash != h || slots[i].key.length() != len) continue;
+      if (!fold) {
+        if (!memcmp(slots[i].key.data(), text, len)) return true;
+      } else {
+        size_t k = 0;
+        while (k < len && fold_byte(text[k]) == (byte)slots[i].key[k]) k++;
+        if (k == len) return true;
+      }
+    }
+    return false;
   }
+};
 
-  // Pass 2: Process matches and compute flags (store in flags_out)
-  int64_t cumulative_delta = 0;
-  PCRE2_SIZE next_valid_int_pos = 0;
+// Match kernels, picked per config at load time from the dictionary size
+// (see select_kernel); -k forces one for benchmarking
+enum {
+  KERNEL_AUTO = -1,
+  KERNEL_REGEX = 0,  // PCRE2 alternation, any lb/la
+  KERNEL_SHIFT_AND,  // bit-parallel, all keys packed into one 32/64-bit word
+  KERNEL_WORD,       // word hash lookup, word-boundary configs
+  KERNEL_DENSE,      // key trie with full 256-entry rows
+  KERNEL_PACKED,     // key trie with sorted edge lists
+  KERNEL_COUNT
+};
 
-  for (size_t match_idx = 0; match_idx < matches.size(); match_idx++) {
-    PCRE2_SIZE int_pos = matches[match_idx].first;
-    PCRE2_SIZE int_end = matches[match_idx].second;
+static const char* kernel_names[KERNEL_COUNT] = {"regex", "shiftand", "word", "dense", "packed"};
 
-    // Skip matches that fall within a previously replaced region
-    if (int_pos < next_valid_int_pos) continue;
+static int kernel_force = KERNEL_AUTO;
 
-    // Position in simulated (and original) = position in intermediate + cumulative delta
-    PCRE2_SIZE sim_pos = int_pos + cumulative_delta;
-    PCRE2_SIZE match_len = int_end - int_pos;
+// Size classes (total bytes of keys incl. case variants), measured with
+// bench_kernels.sh on book1 and enwik_text2
+static const size_t SHIFT_AND_MAX_BYTES = 64;
+static const size_t DENSE_MAX_BYTES = 2048;
 
-    string_view match_str(intermediate.data() + int_pos, match_len);
-    string_view repl = backward[match_str];
+// lb/la as seen by the byte kernels: no condition at all ("" or "(?:)"),
+// or one byte outside a negated class
+struct Boundary {
+  bool any = true;
+  bool ok[256];
+};
 
-    // Check if original at sim_pos matches the replacement
-    bool should = false;
-    if (sim_pos + repl.length() <= original.length()) {
-      string_view orig_view(original.data() + sim_pos, repl.length());
-      should = (orig_view == repl);
-    }
+static bool parse_boundary(const string& pat, Boundary& b) {
+  b.any = pat.empty() || pat == "(?:)";
+  if (b.any) return true;
+  bool word[256];
+  if (!parse_word_class(pat, word)) return false;
+  for (int c = 0; c < 256; c++) b.ok[c] = !word[c];
+  return true;
+}
 
-    // Calculate context for flag record
-    size_t ctx_before = (int_pos >= (size_t)CTX_BEFORE) ? (size_t)CTX_BEFORE : int_pos;
-    size_t remaining_after = intermediate.length() - int_pos - match_len;
-    size_t ctx_after = (remaining_after >= (size_t)CTX_AFTER) ? (size_t)CTX_AFTER : remaining_after;
-    const char* context = intermediate.c_str() + int_pos - ctx_before;
-    int ctx_ofs = (int)ctx_before;
-    int ctx_len = (int)(ctx_before + match_len + ctx_after);
+// Positions where a key can start: first byte of a key, after a byte that
+// lb accepts. With at most 8 distinct first (and second) bytes the scan
+// compares 16 positions per step; bytes are taken with bit 5 set there, so
+// both cases of a letter count once.
+struct StartFilter {
+  bool first[256];
+  int single = -1;  // the only first byte, if there is one (memchr)
+  int nfirst = 0, nsecond = 0;  // nsecond = 0: some key has one byte
+  byte first_bytes[8], second_bytes[8];
+  vector<byte> pair_ok;  // (previous byte << 8 | byte) passes lb and first
+};
 
-    FlagRecord rec;
-    rec.flag = should ? 1 : 0;
-    rec.context.assign(context, ctx_len);
-    rec.ctx_ofs = ctx_ofs;
-    rec.ctx_len = ctx_len;
-    rec.match_len = (int)match_len;
-    flags_out.push_back(rec);
+// Shift-And state layout: key i occupies bits [ofs_i, ofs_i + len_i)
+struct ShiftAnd {
+  uint64_t mask[256];
+  uint64_t init = 0, final = 0;
+  byte len[64];  // key length by final bit
+};
 
-    if (should) {
-      // Update cumulative delta: we're replacing match_len with repl.length()
-      cumulative_delta += (int64_t)repl.length() - (int64_t)match_len;
-      // Skip all matches that start before int_pos + match_len
-      next_valid_int_pos = int_end;
-    }
-  }
+// Trie over the byte keys, walked from each start position; state 0 is
+// the root and also means "no child"
+struct KeyTrie {
+  vector<uint32_t> out_len;    // key length ending at a state, 0 if none
+  vector<int32_t> delta;       // dense: state * 256 + byte
+  vector<uint32_t> edge_ofs;   // packed: edges of state s in [edge_ofs[s], edge_ofs[s+1])
+  vector<byte> edge_byte;
+  vector<int32_t> edge_to;
+  int32_t root[256];           // packed: children of the root
+};
+
+// Matcher for one direction of a config
+struct KeyMatcher {
+  PairMap map;
+  int kernel = KERNEL_REGEX;
+  // word kernel
+  bool word[256];
+  bool first[256];  // first bytes of keys (both cases for templates)
+  WordTable exact_table, fold_table;
+  int max_tokens = 0;
+  size_t min_len = 0, max_len = 0;
+  // byte kernels: keys with case variants spelled out
+  vector<string> variants;
+  vector<string_view> byte_keys;
+  size_t key_bytes = 0;
+  Boundary lb, la;
+  StartFilter start;
+  ShiftAnd sa;
+  KeyTrie trie;
+  // regex kernel
+  pcre2_code* re = nullptr;
+  pcre2_match_data* md = nullptr;
+  string exact_pattern;             // case variants spelled out
+  pcre2_code* exact_re = nullptr;   // compiled on the first case mismatch
+  pcre2_match_data* exact_md = nullptr;
+  string scratch;
+};
 
-  pcre2_match_data_free(match_data);
-  pcre2_code_free(bwd_re);
+// Returns nullptr if the pattern does not compile (e.g. too large)
+static pcre2_code* try_compile_pattern(const string& pattern) {
+  int errcode;
+  PCRE2_SIZE erroffset;
+  pcre2_code* re = pcre2_compile((PCRE2_SPTR)pattern.c_str(), PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
+  if (re) pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+  return re;
 }
 
-// Decompress with a single config - works on in-memory data
-// Reads flags from API, modifies data in-place
-// Returns the number of flags consumed
-qword decompress_single(const ParsedConfig& cfg, string& data) {
-  const string& lb = cfg.lb;
-  const string& la = cfg.la;
-  const vector<ReplacementPair>& pairs = cfg.pairs;
-  unordered_map<string_view, string_view> backward;
-  vector<string_view> backward_keys;
-  pcre2_code *bwd_re;
-  pcre2_match_data *match_data;
-  int rc;
-  PCRE2_SIZE *ovector;
-  PCRE2_SIZE offset;
-  string bwd_pattern;
-  size_t i;
+static pcre2_code* compile_pattern(const string& pattern) {
+  pcre2_code* re = try_compile_pattern(pattern);
+  if (!re) fail("PCRE2 compilation failed");
+  return re;
+}
 
-  if (pairs.empty()) {
-    fprintf(stderr, "No replacement pairs found in config %s\n", cfg.name.c_str());
-    exit(1);
-  }
+// Longest key in words, for n-gram lookups
+static const int MAX_WORD_TOKENS = 8;
 
-  // Reserve space for vectors
-  backward_keys.reserve(pairs.size());
+// Word kernel is usable if every key starts and ends with a word character
+// of the lb/la class (fills in the class and key statistics)
+static bool word_kernel_usable(const ParsedConfig& cfg, KeyMatcher& km) {
+  if (cfg.lb != cfg.la || !parse_word_class(cfg.lb, km.word)) return false;
 
-  // Build backward map (using string_view references to pairs)
-  for (i = 0; i < pairs.size(); i++) {
-    string_view from_view(pairs[i].from);
-    string_view to_view(pairs[i].to);
-    if (backward.find(to_view) == backward.end()) {
-      backward[to_view] = from_view;
-      backward_keys.push_back(to_view);
+  // Caseless templates need the class to treat both cases alike
+  if (!km.map.folded.empty()) {
+    for (int c = 'a'; c <= 'z'; c++) {
+      if (km.word[c] != km.word[c - 32]) return false;
     }
   }
 
-  // Build backward regex pattern
-  bwd_pattern = "(?<=" + lb + ")(" + build_alternation(backward_keys) + ")(?=" + la + ")";
+  vector<string_view> fold_keys;
+  for (const auto& group : km.map.folded) fold_keys.push_back(group.first);
 
-  int errcode;
-  PCRE2_SIZE erroffset;
-  bwd_re = pcre2_compile((PCRE2_SPTR)bwd_pattern.c_str(), PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
-  pcre2_jit_compile(bwd_re, PCRE2_JIT_COMPLETE);
+  memset(km.first, 0, sizeof(km.first));
+  for (string_view k : km.map.keys) {
+    if (!k.empty()) km.first[(byte)k[0]] = true;
+  }
+  for (string_view k : fold_keys) {
+    if (k.empty()) continue;
+    km.first[(byte)k[0]] = true;
+    km.first[(byte)case_variant(k.substr(0, 1), 2)[0]] = true;
+  }
 
-  if (!bwd_re) {
-    fprintf(stderr, "PCRE2 compilation failed\n");
-    exit(1);
+  km.min_len = SIZE_MAX;
+  km.max_len = 0;
+  km.max_tokens = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (string_view k : (pass ? fold_keys : km.map.keys)) {
+      if (k.empty() || !km.word[(byte)k[0]] || !km.word[(byte)k.back()]) return false;
+      int tokens = 1;
+      for (size_t i = 1; i < k.length(); i++) {
+        if (km.word[(byte)k[i]] && !km.word[(byte)k[i - 1]]) tokens++;
+      }
+      if (tokens > MAX_WORD_TOKENS) return false;
+      km.max_tokens = max(km.max_tokens, tokens);
+      km.min_len = min(km.min_len, k.length());
+      km.max_len = max(km.max_len, k.length());
+    }
   }
+  return true;
+}
+
+// Word-token engine: leftmost word start at or after offset where some key
+// (the longest one) covers whole words and is followed by a non-word byte
+static bool word_find(KeyMatcher& km, string_view subject, size_t offset, size_t& start, size_t& end) {
+  const TokenIndex& ti = token_index_get(subject, km.word);
+  const byte* p = (const byte*)subject.data();
+  const bool fold = !km.map.folded.empty();
+  size_t n = subject.length();
+  size_t ends[MAX_WORD_TOKENS];
+  uint64_t hx[MAX_WORD_TOKENS], hf[MAX_WORD_TOKENS];
+
+  size_t s = next_word_start(ti, offset);
+  while (s < n) {
+    if (!km.first[p[s]]) {
+      s = next_word_start(ti, next_word_end(ti, s));
+      continue;
+    }
 
-  match_data = pcre2_match_data_create_from_pattern(bwd_re, NULL);
+    // Hash the word and the following n-grams up to the longest key
+    int cnt = 0;
+    uint64_t h = 0, hl = 0;
+    size_t pos = s;
+    size_t e = next_word_end(ti, s);
+    while (true) {
+      for (; pos < e; pos++) {
+        h = word_hash_step(h, p[pos]);
+        if (fold) hl = word_hash_step(hl, fold_byte(p[pos]));
+      }
+      ends[cnt] = e;
+      hx[cnt] = h;
+      hf[cnt] = hl;
+      cnt++;
+      if (cnt == km.max_tokens || e - s >= km.max_len) break;
+      size_t s2 = next_word_start(ti, e);
+      if (s2 >= n || s2 - s > km.max_len) break;
+      e = next_word_end(ti, s2);
+    }
 
-  // Apply replacements using flags, build output string
-  string output;
-  output.reserve(data.length() * 2);
+    for (int t = cnt - 1; t >= 0; t--) {
+      size_t len = ends[t] - s;
+      if (ends[t] >= n || len < km.min_len || len > km.max_len) continue;
+      const char* text = subject.data() + s;
+      if (km.exact_table.find(hx[t], text, len, false) || (fold && km.fold_table.find(hf[t], text, len, true))) {
+        string_view repl;
+        if (pair_lookup(km.map, string_view(text, len), repl, km.scratch)) {
+          start = s;
+          end = ends[t];
+          return true;
+        }
+      }
+    }
 
-  offset = 0;
-  qword last_end = 0;
-  qword flag_count = 0;
-  vector<char> seen_pos(data.length(), 0);
+    s = next_word_start(ti, ends[0]);
+  }
+  return false;
+}
 
-  while (offset < data.length()) {
-    rc = pcre2_jit_match(bwd_re, (PCRE2_SPTR)data.c_str(), data.length(), offset, 0, match_data, NULL);
+// Byte kernels (Shift-And, tries) match the spelled-out keys and check
+// lb/la on the neighbouring bytes. Start positions come from StartFilter.
 
-    if (rc < 0)
-      break;
+// Collect byte keys: explicit keys plus all case variants of templates
+static bool byte_kernel_usable(const ParsedConfig& cfg, KeyMatcher& km) {
+  for (const auto& group : km.map.folded) {
+    for (const FoldEntry& e : group.second) {
+      for (int cls = 0; cls < 3; cls++) km.variants.push_back(case_variant(e.key, cls));
+    }
+  }
+  km.byte_keys = km.map.keys;
+  for (const string& v : km.variants) km.byte_keys.push_back(v);
+  sort(km.byte_keys.begin(), km.byte_keys.end());
+  km.byte_keys.erase(unique(km.byte_keys.begin(), km.byte_keys.end()), km.byte_keys.end());
+  if (!parse_boundary(cfg.lb, km.lb) || !parse_boundary(cfg.la, km.la)) return false;
+
+  km.key_bytes = 0;
+  km.max_len = 0;
+  for (string_view k : km.byte_keys) {
+    if (k.empty()) return false;
+    km.key_bytes += k.length();
+    km.max_len = max(km.max_len, k.length());
+  }
+  return true;
+}
 
-    ovector = pcre2_get_ovector_pointer(match_data);
-    PCRE2_SIZE pos, end;
-    pos = ovector[0];
-    end = ovector[1];
+static void build_start_filter(KeyMatcher& km) {
+  StartFilter& sf = km.start;
+  bool first[256] = {}, second[256] = {};
+  bool short_key = false;
+  int raw = 0;
+  memset(sf.first, 0, sizeof(sf.first));
+  for (string_view k : km.byte_keys) {
+    if (!sf.first[(byte)k[0]]) raw++;
+    sf.first[(byte)k[0]] = true;
+    first[(byte)k[0] | 0x20] = true;
+    if (k.length() < 2) short_key = true;
+    else second[(byte)k[1] | 0x20] = true;
+  }
+  for (int c = 0; c < 256; c++) {
+    if (sf.first[c] && raw == 1) sf.single = c;
+    if (first[c] && sf.nfirst <= 8) {
+      if (sf.nfirst < 8) sf.first_bytes[sf.nfirst] = c;
+      sf.nfirst++;
+    }
+    if (second[c] && !short_key && sf.nsecond <= 8) {
+      if (sf.nsecond < 8) sf.second_bytes[sf.nsecond] = c;
+      sf.nsecond++;
+    }
+  }
+  if (sf.nsecond > 8) sf.nsecond = 0;
 
-    bool should_replace = false;
+  if (!km.lb.any) {
+    sf.pair_ok.assign(65536, 0);
+    for (int a = 0; a < 256; a++) {
+      for (int c = 0; c < 256; c++) sf.pair_ok[a << 8 | c] = km.lb.ok[a] && sf.first[c];
+    }
+  }
+}
 
-    if (!seen_pos[pos]) {
-      seen_pos[pos] = true;
+static inline bool lb_accepts(const KeyMatcher& km, const byte* p, size_t j) {
+  return km.lb.any || (j > 0 && km.lb.ok[p[j - 1]]);
+}
 
-      // Calculate context for API call
-      PCRE2_SIZE match_len = end - pos;
-      size_t ctx_before = (pos >= (size_t)CTX_BEFORE) ? (size_t)CTX_BEFORE : pos;
-      size_t remaining_after = data.length() - pos - match_len;
-      size_t ctx_after = (remaining_after >= (size_t)CTX_AFTER) ? (size_t)CTX_AFTER : remaining_after;
-      const char* context = data.c_str() + pos - ctx_before;
-      int ctx_ofs = (int)ctx_before;
-      int ctx_len = (int)(ctx_before + match_len + ctx_after);
+static inline bool la_accepts(const KeyMatcher& km, const byte* p, size_t n, size_t e) {
+  return km.la.any || (e < n && km.la.ok[p[e]]);
+}
 
-      int c = API(-3, context, ctx_ofs, ctx_len, (int)match_len);
-      if (c != -1) {
-        should_replace = (c == 1);
-        flag_count++;
+// Next position at or after j that passes the start filter, n if none
+static size_t next_start(const KeyMatcher& km, const byte* p, size_t j, size_t n) {
+  const StartFilter& sf = km.start;
+  if (sf.single >= 0) {
+    while (j < n) {
+      const byte* q = (const byte*)memchr(p + j, sf.single, n - j);
+      if (!q) return n;
+      j = q - p;
+      if (lb_accepts(km, p, j)) return j;
+      j++;
+    }
+    return n;
+  }
+#ifdef HAVE_SSE2
+  if (sf.nfirst <= 8) {
+    __m128i f[8], g[8], bit5 = _mm_set1_epi8(0x20);
+    for (int i = 0; i < sf.nfirst; i++) f[i] = _mm_set1_epi8((char)sf.first_bytes[i]);
+    for (int i = 0; i < sf.nsecond; i++) g[i] = _mm_set1_epi8((char)sf.second_bytes[i]);
+    for (; j + 17 <= n; j += 16) {
+      __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + j)), bit5);
+      __m128i m = _mm_cmpeq_epi8(a, f[0]);
+      for (int i = 1; i < sf.nfirst; i++) m = _mm_or_si128(m, _mm_cmpeq_epi8(a, f[i]));
+      if (sf.nsecond) {
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + j + 1)), bit5);
+        __m128i m2 = _mm_cmpeq_epi8(b, g[0]);
+        for (int i = 1; i < sf.nsecond; i++) m2 = _mm_or_si128(m2, _mm_cmpeq_epi8(b, g[i]));
+        m = _mm_and_si128(m, m2);
       }
+      int bits = _mm_movemask_epi8(m);
+      while (bits) {
+        size_t q = j + ctz64(bits);
+        if (sf.first[p[q]] && lb_accepts(km, p, q)) return q;
+        bits &= bits - 1;
+      }
+    }
+  }
+#endif
+  if (km.lb.any) {
+    while (j < n && !sf.first[p[j]]) j++;
+    return j;
+  }
+  if (j == 0) {
+    if (n == 0) return 0;
+    j = 1;  // lb needs a byte before the start
+  }
+  while (j < n && !sf.pair_ok[p[j - 1] << 8 | p[j]]) j++;
+  return j;
+}
+
+static void build_shift_and(KeyMatcher& km) {
+  ShiftAnd& sa = km.sa;
+  memset(sa.mask, 0, sizeof(sa.mask));
+  int bit = 0;
+  for (string_view k : km.byte_keys) {
+    sa.init |= (uint64_t)1 << bit;
+    for (size_t i = 0; i < k.length(); i++) sa.mask[(byte)k[i]] |= (uint64_t)1 << (bit + i);
+    bit += k.length();
+    sa.final |= (uint64_t)1 << (bit - 1);
+    sa.len[bit - 1] = k.length();
+  }
+}
+
+// Shift-And over all keys at once; matches are reported by end position,
+// so the scan goes on until no earlier start is possible
+template <class T>
+static bool shift_and_find(const KeyMatcher& km, string_view subject, size_t offset, size_t& start, size_t& end) {
+  const ShiftAnd& sa = km.sa;
+  const byte* p = (const byte*)subject.data();
+  size_t n = subject.length();
+  const T init = (T)sa.init, final = (T)sa.final;
+  size_t best_s = SIZE_MAX, best_e = 0;
+  T d = 0;
+
+  for (size_t j = offset; j < n; j++) {
+    if (!d) {
+      if (best_s != SIZE_MAX) break;  // anything found from here on starts later
+      j = next_start(km, p, j, n);
+      if (j == n) break;
+    } else if (best_s != SIZE_MAX && j >= best_s + km.max_len) {
+      break;
     }
+    d = ((d << 1) | init) & (T)sa.mask[p[j]];
+    T hit = d & final;
+    while (hit) {
+      int b = ctz64(hit);
+      hit &= hit - 1;
+      size_t s = j + 1 - sa.len[b], e = j + 1;
+      if (s > best_s || (s == best_s && e <= best_e)) continue;
+      if (!lb_accepts(km, p, s) || !la_accepts(km, p, n, e)) continue;
+      best_s = s;
+      best_e = e;
+    }
+  }
 
-    if (should_replace) {
-      // Write unmatched portion before this match
-      if (pos > last_end) {
-        output.append(data.c_str() + last_end, pos - last_end);
+  if (best_s == SIZE_MAX) return false;
+  start = best_s;
+  end = best_e;
+  return true;
+}
+
+static void build_trie(KeyMatcher& km, bool dense) {
+  KeyTrie& tr = km.trie;
+
+  // Child lists, sorted by byte
+  vector<vector<pair<byte, int32_t>>> next(1);
+  tr.out_len.assign(1, 0);
+  for (string_view k : km.byte_keys) {
+    int32_t s = 0;
+    for (char ch : k) {
+      byte c = ch;
+      auto it = lower_bound(next[s].begin(), next[s].end(), make_pair(c, (int32_t)0));
+      if (it == next[s].end() || it->first != c) {
+        int32_t t = next.size();
+        next[s].insert(it, {c, t});
+        next.emplace_back();
+        tr.out_len.push_back(0);
+        s = t;
+      } else {
+        s = it->second;
       }
+    }
+    tr.out_len[s] = k.length();
+  }
 
-      // Write replacement
-      string_view match_str(data.data() + pos, end - pos);
-      string_view repl = backward[match_str];
-      output.append(repl.data(), repl.length());
+  size_t states = next.size();
+  if (dense) {
+    tr.delta.assign(states * 256, 0);
+    for (size_t s = 0; s < states; s++) {
+      for (auto& e : next[s]) tr.delta[s * 256 + e.first] = e.second;
+    }
+    return;
+  }
 
-      last_end = end;
-      offset = end;
-    } else {
-      // Don't replace, continue from next position
-      offset = pos + 1;
+  tr.edge_ofs.assign(states + 1, 0);
+  for (size_t s = 0; s < states; s++) {
+    tr.edge_ofs[s + 1] = tr.edge_ofs[s] + next[s].size();
+    for (auto& e : next[s]) {
+      tr.edge_byte.push_back(e.first);
+      tr.edge_to.push_back(e.second);
     }
   }
+  for (int c = 0; c < 256; c++) tr.root[c] = 0;
+  for (auto& e : next[0]) tr.root[e.first] = e.second;
+}
 
-  // Write remaining portion
-  if (last_end < data.length()) {
-    output.append(data.c_str() + last_end, data.length() - last_end);
+static inline int32_t packed_child(const KeyTrie& tr, int32_t s, byte c) {
+  if (!s) return tr.root[c];
+  for (uint32_t i = tr.edge_ofs[s]; i < tr.edge_ofs[s + 1]; i++) {
+    if (tr.edge_byte[i] >= c) return tr.edge_byte[i] == c ? tr.edge_to[i] : 0;
   }
+  return 0;
+}
 
-  pcre2_match_data_free(match_data);
-  pcre2_code_free(bwd_re);
+// Walk the trie from each start position; the first position with a key
+// (the longest one that la accepts) is the leftmost match
+template <bool DENSE>
+static bool trie_find(const KeyMatcher& km, string_view subject, size_t offset, size_t& start, size_t& end) {
+  const KeyTrie& tr = km.trie;
+  const byte* p = (const byte*)subject.data();
+  size_t n = subject.length();
+
+  for (size_t j = next_start(km, p, offset, n); j < n; j = next_start(km, p, j + 1, n)) {
+    size_t e = 0;
+    int32_t s = 0;
+    for (size_t i = j; i < n; i++) {
+      s = DENSE ? tr.delta[s * 256 + p[i]] : packed_child(tr, s, p[i]);
+      if (!s) break;
+      if (tr.out_len[s] && la_accepts(km, p, n, i + 1)) e = i + 1;
+    }
+    if (e) {
+      start = j;
+      end = e;
+      return true;
+    }
+  }
+  return false;
+}
 
-  data = std::move(output);
-  return flag_count;
+// Pick a kernel from the dictionary size class; a forced kernel that cannot
+// handle the config falls back to the automatic choice
+static int select_kernel(const ParsedConfig& cfg, KeyMatcher& km, int& automatic) {
+  bool byte_ok = byte_kernel_usable(cfg, km);
+  size_t byte_max_len = km.max_len;
+  bool word_ok = word_kernel_usable(cfg, km);
+  km.max_len = max(km.max_len, byte_max_len);
+
+  if (!byte_ok) automatic = word_ok ? KERNEL_WORD : KERNEL_REGEX;
+  else if (km.key_bytes <= SHIFT_AND_MAX_BYTES) automatic = KERNEL_SHIFT_AND;
+  else if (km.key_bytes <= DENSE_MAX_BYTES) automatic = KERNEL_DENSE;
+  else automatic = word_ok ? KERNEL_WORD : KERNEL_PACKED;
+
+  switch (kernel_force) {
+  case KERNEL_REGEX:
+    return KERNEL_REGEX;
+  case KERNEL_SHIFT_AND:
+    return byte_ok && km.key_bytes <= SHIFT_AND_MAX_BYTES ? KERNEL_SHIFT_AND : automatic;
+  case KERNEL_WORD:
+    return word_ok ? KERNEL_WORD : automatic;
+  case KERNEL_DENSE:
+  case KERNEL_PACKED:
+    return byte_ok ? kernel_force : automatic;
+  }
+  return automatic;
 }
 
-// Compress mode - works on in-memory data, handles list mode
-// API(-1) must be called before this function, API(-2) after
-uint mode_compress(const vector<ParsedConfig>& configs, string& data, const char* flg_file ) {
-  // For list mode, we need to:
-  // 1. Apply transformations in forward order (configs[0], configs[1], ...)
-  // 2. Collect flags for each config
-  // 3. Write flags to API in reverse config order (for decompression)
+void build_matcher(const ParsedConfig& cfg, bool backward, KeyMatcher& km) {
+  build_pair_map(cfg.pairs, backward, km.map);
+  int automatic;
+  km.kernel = select_kernel(cfg, km, automatic);
 
-  vector<vector<FlagRecord>> all_flags(configs.size());
-  string current = data;
-  string intermediate;
+  if (km.kernel == KERNEL_REGEX) {
+    string pattern = "(?<=" + cfg.lb + ")(" + build_alternation(km.map.keys, km.map.fold_keys) + ")(?=" + cfg.la + ")";
+    km.re = try_compile_pattern(pattern);
+    if (!km.re && automatic == KERNEL_REGEX) fail("PCRE2 compilation failed");
+  }
+  if (km.kernel == KERNEL_REGEX && km.re) {
+    km.md = pcre2_match_data_create_from_pattern(km.re, NULL);
+    if (!km.map.fold_keys.empty()) {
+      vector<string_view> keys(km.map.keys);
+      for (const string& v : km.variants) keys.push_back(v);
+      km.exact_pattern = "(?<=" + cfg.lb + ")(" + build_alternation(keys) + ")(?=" + cfg.la + ")";
+    }
+    return;
+  }
+  if (km.kernel == KERNEL_REGEX) km.kernel = automatic;  // too large for PCRE2
+
+  if (km.kernel == KERNEL_WORD) {
+    vector<string_view> fold_keys;
+    for (const auto& group : km.map.folded) fold_keys.push_back(group.first);
+    km.exact_table.build(km.map.keys);
+    km.fold_table.build(fold_keys);
+    return;
+  }
 
-  // Process configs in forward order
-  for (size_t i = 0; i < configs.size(); i++) {
-    qword size_before = current.length();
-    compress_single(configs[i], current, intermediate, all_flags[i]);
-    current = std::move(intermediate);
-    fprintf(stderr, "Config %s: %llu -> %llu bytes, %llu flags\n",
-            configs[i].name.c_str(), size_before, (qword)current.length(), (qword)all_flags[i].size());
+  build_start_filter(km);
+  if (km.kernel == KERNEL_SHIFT_AND) build_shift_and(km);
+  else build_trie(km, km.kernel == KERNEL_DENSE);
+}
+
+void free_matcher(KeyMatcher& km) {
+  if (km.md) pcre2_match_data_free(km.md);
+  if (km.re) pcre2_code_free(km.re);
+  if (km.exact_md) pcre2_match_data_free(km.exact_md);
+  if (km.exact_re) pcre2_code_free(km.exact_re);
+  km = KeyMatcher();
+}
+
+// Matchers built once for many runs (serve and batch workers): the scans
+// take them instead of building their own per run, see prebuild_matchers.
+// Byte kernels only read their matcher while scanning, so the scan threads
+// share one; the regex and word kernels get one per scan thread.
+struct FusedMatcher;
+struct PrebuiltMatchers {
+  KeyMatcher fwd;
+  vector<KeyMatcher> bwd;           // per scan thread, or one to share
+  size_t group = 0;                 // size of the fused group the config starts
+  shared_ptr<FusedMatcher> fused[2];  // forward and backward matcher of that group
+
+  ~PrebuiltMatchers() {
+    free_matcher(fwd);
+    for (KeyMatcher& km : bwd) free_matcher(km);
   }
+};
 
-  // Initialize API for encoding (write mode)
-  if( API(-1, flg_file, 0, 0, 0)!=0 ) return 1; // error
+static bool matcher_shared(const KeyMatcher& km) {
+  return km.kernel == KERNEL_SHIFT_AND || km.kernel == KERNEL_DENSE || km.kernel == KERNEL_PACKED;
+}
 
-  // Calculate total flags for progress reporting
-  qword total_flag_count = 0;
-  for (size_t i = 0; i < all_flags.size(); i++) {
-    total_flag_count += all_flags[i].size();
+// Matcher of a config for scan thread t: the prebuilt one, else own, built
+// here (the caller frees own)
+static KeyMatcher& use_matcher(const ParsedConfig& cfg, bool backward, KeyMatcher& own, size_t t = 0) {
+  if (PrebuiltMatchers* pm = cfg.prebuilt.get()) {
+    if (!backward) return pm->fwd;
+    if (t < pm->bwd.size()) return pm->bwd[t];
+    if (matcher_shared(pm->bwd[0])) return pm->bwd[0];
   }
+  build_matcher(cfg, backward, own);
+  return own;
+}
 
-  // Write flags in reverse config order (for decompression which processes in reverse)
-  qword flags_written = 0;
-  int last_percent = -1;
-  for (int i = (int)configs.size() - 1; i >= 0; i--) {
-    for (size_t j = 0; j < all_flags[i].size(); j++) {
-      const FlagRecord& rec = all_flags[i][j];
-      API(rec.flag, rec.context.c_str(), rec.ctx_ofs, rec.ctx_len, rec.match_len);
-      flags_written++;
+// Find the leftmost match starting at or after offset
+bool find_match(KeyMatcher& km, string_view subject, size_t offset, size_t& start, size_t& end) {
+  switch (km.kernel) {
+  case KERNEL_WORD:
+    return word_find(km, subject, offset, start, end);
+  case KERNEL_SHIFT_AND:
+    if (km.key_bytes <= 32) return shift_and_find<uint32_t>(km, subject, offset, start, end);
+    return shift_and_find<uint64_t>(km, subject, offset, start, end);
+  case KERNEL_DENSE:
+    return trie_find<true>(km, subject, offset, start, end);
+  case KERNEL_PACKED:
+    return trie_find<false>(km, subject, offset, start, end);
+  }
 
-      // Progress reporting
-      int percent = (total_flag_count > 0) ? (int)(flags_written * 100 / total_flag_count) : 100;
-      if (percent != last_percent) {
-        fprintf(stderr, "\rWriting flags: %d%%", percent);
-        fflush(stderr);
-        last_percent = percent;
-      }
+  while (offset < subject.length()) {
+    int rc = pcre2_jit_match(km.re, (PCRE2_SPTR)subject.data(), subject.length(), offset, 0, km.md, NULL);
+    if (rc < 0) return false;
+
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(km.md);
+    start = ovector[0];
+    end = ovector[1];
+    if (km.map.folded.empty()) return true;
+
+    string_view repl;
+    if (pair_lookup(km.map, string_view(subject.data() + start, end - start), repl, km.scratch)) return true;
+
+    // Caseless match that no pair declares: redo this position with exact variants
+    if (!km.exact_re) {
+      km.exact_re = compile_pattern(km.exact_pattern);
+      km.exact_md = pcre2_match_data_create_from_pattern(km.exact_re, NULL);
     }
+    rc = pcre2_match(km.exact_re, (PCRE2_SPTR)subject.data(), subject.length(), start, PCRE2_ANCHORED, km.exact_md, NULL);
+    if (rc >= 0) {
+      ovector = pcre2_get_ovector_pointer(km.exact_md);
+      start = ovector[0];
+      end = ovector[1];
+      return true;
+    }
+    offset = start + 1;
   }
-  fprintf(stderr, "\r                    \r");  // Clear progress line
+  return false;
+}
 
-  API(-2, nullptr, 0, 0, 0);  // Close flags file
+// Host state for a transform stage run (callbacks from stage_api.h)
+struct StageHost {
+  string* output;
+  vector<FlagRecord>* flags;  // forward: flags to cache
+  qword flag_count;           // backward: flags read
+};
 
-  data = std::move(current);
-  fprintf(stderr, "Total flags: %llu\n", (qword)flags_written);
+static void stage_out(void* host, const char* data, size_t len) {
+  ((StageHost*)host)->output->append(data, len);
+}
 
-  return 0;
+static void stage_flag(void* host, int bit, const char* ctx, int ofs, int len, int mlen) {
+  FlagRecord rec;
+  rec.flag = bit ? 1 : 0;
+  rec.context.assign(ctx, len);
+  rec.ctx_ofs = ofs;
+  rec.ctx_len = len;
+  rec.match_len = mlen;
+  ((StageHost*)host)->flags->push_back(rec);
 }
 
-// Decompress mode - works on in-memory data, handles list mode
-// API(-1) must be called before this function, API(-2) after
-void mode_decompress(const vector<ParsedConfig>& configs, string& data) {
-  qword total_flags = 0;
-  // Process configs in reverse order
-  for (int i = (int)configs.size() - 1; i >= 0; i--) {
-    qword len_before = data.length();
-    qword flag_count = decompress_single(configs[i], data);
-    fprintf(stderr, "Config %s: %llu -> %llu bytes, %llu flags\n",
-            configs[i].name.c_str(), (qword)len_before, (qword)data.length(), flag_count);
-    total_flags += flag_count;
+static int stage_getflag(void* host, const char* ctx, int ofs, int len, int mlen) {
+  if (API_FEATURES) {
+    FlagFeatures f = {feature_config, -1};
+    API_FEATURES(&f);
   }
-  fprintf(stderr, "Total flags: %llu\n", total_flags);
+  int c = API(-3, ctx, ofs, len, mlen);
+  if (c != -1) ((StageHost*)host)->flag_count++;
+  return c;
 }
 
-int main(int argc, char **argv) {
-  if (argc < 6 || argc > 7) {
-    fprintf(stderr,
-            "Usage: %s <mode> <config> <input> <output> <flags> [dll]\n"
-            "Modes:\n"
+// Run a transform stage over input in chunks of STAGE_CHUNK bytes
+// op is STAGE_FORWARD or STAGE_BACKWARD, output is replaced
+void run_stage(const ParsedConfig& cfg, int op, const string& input, string& output, StageHost& host) {
+  StageIO io;
+  string pending;  // unconsumed tail of the previous chunk
+  size_t pos = 0;
+
+  output.clear();
+  output.reserve(input.length());
+  host.output = &output;
+
+  memset(&io, 0, sizeof(io));
+  io.arg = cfg.stage_arg.c_str();
+  io.host = &host;
+  io.out = stage_out;
+  io.flag = stage_flag;
+  io.getflag = stage_getflag;
+
+  if (cfg.stage_fn(STAGE_INIT, &io) != 0) fail("Stage %s failed to initialize", cfg.stage.c_str());
+
+  while (true) {
+    size_t n = min(STAGE_CHUNK, input.length() - pos);
+    if (pending.empty()) {
+      io.in = input.data() + pos;
+      io.in_len = n;
+    } else {
+      pending.append(input.data() + pos, n);
+      io.in = pending.data();
+      io.in_len = pending.length();
+    }
+    pos += n;
+    io.final = (pos == input.length());
+
+    int used = cfg.stage_fn(op, &io);
+    if (used < 0 || (size_t)used > io.in_len || (io.final && (size_t)used != io.in_len)) {
+      fail("Stage %s failed", cfg.stage.c_str());
+    }
+    if (io.final) break;
+
+    if (pending.empty()) {
+      pending.assign(io.in + used, io.in_len - used);
+    } else {
+      pending.erase(0, used);
+    }
+  }
+
+  cfg.stage_fn(STAGE_DONE, &io);
+}
+
+// Piece table: configs of a list pass edit lists to each other instead of
+// full buffers. A view is a sequence of pieces of the run input (or of the
+// output of the last transform stage) and of replacement text; the full
+// buffer is built once, at the end of the run.
+
+struct PieceStore {
+  string_view base;  // run input or output of the last transform stage
+  string owned;      // base unless it is the caller's buffer (library)
+  string added;      // replacement text written since then
+
+  void own(string&& s) {
+    owned = std::move(s);
+    base = owned;
+  }
+};
+
+struct Piece {
+  bool added;  // piece of store.added, else of store.base
+  size_t ofs;
+  size_t len;
+};
+
+struct PieceView {
+  const PieceStore* store = nullptr;
+  vector<Piece> pieces;
+  vector<size_t> at;  // view position of each piece
+  size_t length = 0;
+};
+
+// Replacement made by a config: position and length in its input, and its
+// text in store.added
+struct Edit {
+  size_t pos;
+  size_t old_len;
+  size_t new_len;
+  size_t text;
+};
+
+// Views are scanned in windows of this many start positions
+static const size_t VIEW_WINDOW = 1 << 20;
+
+static void view_push(PieceView& v, const Piece& p) {
+  if (!p.len) return;
+  if (!v.pieces.empty()) {
+    Piece& last = v.pieces.back();
+    if (last.added == p.added && last.ofs + last.len == p.ofs) {
+      last.len += p.len;
+      v.length += p.len;
+      return;
+    }
+  }
+  v.pieces.push_back(p);
+  v.at.push_back(v.length);
+  v.length += p.len;
+}
+
+static void view_flat(const PieceStore& store, PieceView& v) {
+  v.store = &store;
+  v.pieces.clear();
+  v.at.clear();
+  v.length = 0;
+  view_push(v, {false, 0, store.base.length()});
+}
+
+// Index of the piece holding view position pos
+static size_t view_piece(const PieceView& v, size_t pos) {
+  return upper_bound(v.at.begin(), v.at.end(), pos) - v.at.begin() - 1;
+}
+
+// Append v[pos, pos + len) to out
+static void view_append(PieceView& out, const PieceView& v, size_t pos, size_t len) {
+  for (size_t i = len ? view_piece(v, pos) : 0; len; i++) {
+    const Piece& p = v.pieces[i];
+    size_t skip = pos - v.at[i];
+    size_t take = min(len, p.len - skip);
+    view_push(out, {p.added, p.ofs + skip, take});
+    pos += take;
+    len -= take;
+  }
+}
+
+// Copy v[pos, pos + len) into out
+static void view_read(const PieceView& v, size_t pos, size_t len, string& out) {
+  out.clear();
+  out.reserve(len);
+  for (size_t i = len ? view_piece(v, pos) : 0; len; i++) {
+    const Piece& p = v.pieces[i];
+    string_view src = p.added ? v.store->added : v.store->base;
+    size_t skip = pos - v.at[i];
+    size_t take = min(len, p.len - skip);
+    out.append(src.data() + p.ofs + skip, take);
+    pos += take;
+    len -= take;
+  }
+}
+
+// v[pos, pos + len) in place if one piece holds it, else copied to scratch
+static const char* view_span(const PieceView& v, size_t pos, size_t len, string& scratch) {
+  if (len) {
+    size_t i = view_piece(v, pos);
+    const Piece& p = v.pieces[i];
+    if (pos + len <= v.at[i] + p.len) return (p.added ? v.store->added : v.store->base).data() + p.ofs + pos - v.at[i];
+  }
+  view_read(v, pos, len, scratch);
+  return scratch.c_str();
+}
+
+// out = in with sorted, non-overlapping edits applied
+static void view_apply(const PieceView& in, const vector<Edit>& edits, PieceView& out) {
+  out.store = in.store;
+  out.pieces.clear();
+  out.at.clear();
+  out.length = 0;
+  size_t pos = 0;
+  for (const Edit& e : edits) {
+    view_append(out, in, pos, e.pos - pos);
+    view_push(out, {true, e.text, e.new_len});
+    pos = e.pos + e.old_len;
+  }
+  view_append(out, in, pos, in.length - pos);
+}
+
+// Bytes a window needs after its last start: the longest key plus the
+// byte la looks at. 0 if lb/la are not byte classes (one window for all)
+static size_t view_margin(const ParsedConfig& cfg) {
+  Boundary lb, la;
+  if (!parse_boundary(cfg.lb, lb) || !parse_boundary(cfg.la, la)) return 0;
+  size_t longest = 0;
+  for (const ReplacementPair& rp : cfg.pairs) longest = max(longest, max(rp.from.length(), rp.to.length()));
+  return longest + 1;
+}
+
+// Starts of v a window can scan in place from pos on: the window v[pos - 1,
+// end + ahead) lies in the piece holding pos (0 if it does not)
+static size_t view_inplace_end(const PieceView& v, size_t ahead, size_t pos) {
+  size_t i = view_piece(v, pos);
+  size_t lo = pos ? pos - 1 : 0, end = v.at[i] + v.pieces[i].len;
+  if (lo < v.at[i]) return 0;
+  if (end == v.length) return end;
+  return end > pos + ahead ? end - ahead : 0;
+}
+
+// Scan a view window by window: window holds v[s0 - 1, s1 + ahead) (the
+// byte before for lb), at is the view position of window[0] and matches
+// may start at window indexes [from, to). Within each VIEW_WINDOW of
+// starts, the starts whose window lies in one piece are scanned in place;
+// only the margins around piece boundaries are copied. ahead = 0 scans one
+// window with the whole view, which is copied unless the view is flat.
+// Windows first to last - 1 are scanned, all by default.
+template <class F>
+static void scan_windows(const PieceView& v, size_t ahead, F scan, size_t first = 0, size_t last = SIZE_MAX) {
+  string window;
+  if (!ahead) {
+    if (v.pieces.size() == 1 && !v.pieces[0].added && v.length == v.store->base.length()) {
+      scan(v.store->base, 0, 0, v.length);
+      return;
+    }
+    view_read(v, 0, v.length, window);
+    scan(window, 0, 0, v.length);
+    token_index_release(window);
+    return;
+  }
+  for (size_t w0 = first * VIEW_WINDOW; w0 < v.length && w0 < last * VIEW_WINDOW; w0 += VIEW_WINDOW) {
+    size_t w1 = min(v.length, w0 + VIEW_WINDOW);
+    for (size_t s0 = w0, s1; s0 < w1; s0 = s1) {
+      size_t a = s0 ? s0 - 1 : 0;
+      s1 = min(w1, view_inplace_end(v, ahead, s0));
+      if (s1 > s0) {
+        size_t i = view_piece(v, s0);
+        const Piece& p = v.pieces[i];
+        string_view src = p.added ? v.store->added : v.store->base;
+        string_view in_place(src.data() + p.ofs + a - v.at[i], min(v.length, s1 + ahead) - a);
+        scan(in_place, a, s0 - a, s1 - a);
+        token_index_release(in_place);
+        continue;
+      }
+      // Margin: up to the first start after a piece boundary that has its
+      // window in place again
+      s1 = s0;
+      do {
+        size_t i = view_piece(v, s1);
+        size_t end = v.at[i] + v.pieces[i].len;
+        s1 = s1 + ahead >= end ? end + 1 : s1 + 1;
+      } while (s1 < w1 && view_inplace_end(v, ahead, s1) <= s1);
+      s1 = min(s1, w1);
+      size_t b = min(v.length, s1 + ahead);
+      token_index_release(window);
+      view_read(v, a, b - a, window);
+      scan(window, a, s0 - a, s1 - a);
+    }
+  }
+  token_index_release(window);
+}
+
+// Threads for scans that collect the match at every start
+static int scan_threads = max(1, (int)std::thread::hardware_concurrency());
+
+// Split the windows of v into at most max_parts consecutive ranges and run
+// part(t, first, last) for range t, each on its own thread. Returns the
+// number of ranges (1 if the view is scanned as one window).
+template <class F>
+static size_t scan_parallel(const PieceView& v, size_t ahead, size_t max_parts, F part) {
+  size_t windows = (v.length + VIEW_WINDOW - 1) / VIEW_WINDOW;
+  size_t parts = ahead ? min(max_parts, windows) : 1;
+  if (parts <= 1) {
+    part(0, 0, SIZE_MAX);
+    return 1;
+  }
+  vector<std::thread> pool;
+  for (size_t t = 1; t < parts; t++) pool.emplace_back(part, t, windows * t / parts, windows * (t + 1) / parts);
+  part(0, 0, windows / parts);
+  for (std::thread& th : pool) th.join();
+  return parts;
+}
+
+// Longest backward match at every start of v. The windows are independent,
+// so they are split over scan_threads threads, each with its own matcher.
+static void collect_matches(const ParsedConfig& cfg, KeyMatcher& bwd, const PieceView& v,
+                            vector<pair<size_t, size_t>>& out) {
+  vector<vector<pair<size_t, size_t>>> parts(scan_threads);
+  size_t n = scan_parallel(v, view_margin(cfg), scan_threads, [&](size_t t, size_t first, size_t last) {
+    KeyMatcher local;
+    KeyMatcher& km = t ? use_matcher(cfg, true, local, t) : bwd;
+    scan_windows(v, view_margin(cfg), [&](string_view window, size_t at, size_t from, size_t to) {
+      size_t offset = from, start, end;
+      while (find_match(km, window, offset, start, end) && start < to) {
+        parts[t].push_back({at + start, at + end});
+        offset = start + 1;
+      }
+    }, first, last);
+    if (t) free_matcher(local);
+  });
+
+  out.clear();
+  for (size_t t = 0; t < n; t++) out.insert(out.end(), parts[t].begin(), parts[t].end());
+}
+
+// Pass 2 of compression: decide a flag for each backward match in
+// intermediate, by checking whether original holds the replacement there
+static void compute_flags(const PairMap& map, string& scratch, const PieceView& original, const PieceView& intermediate,
+                          const vector<pair<size_t, size_t>>& matches, vector<FlagRecord>& flags_out) {
+  int64_t cumulative_delta = 0;
+  size_t next_valid_int_pos = 0;
+  string orig_text;
+
+  for (size_t match_idx = 0; match_idx < matches.size(); match_idx++) {
+    size_t int_pos = matches[match_idx].first;
+    size_t int_end = matches[match_idx].second;
+
+    // Skip matches that fall within a previously replaced region
+    if (int_pos < next_valid_int_pos) continue;
+
+    // Position in simulated (and original) = position in intermediate + cumulative delta
+    size_t sim_pos = int_pos + cumulative_delta;
+    size_t match_len = int_end - int_pos;
+
+    // Context for the flag record
+    size_t ctx_before = min(int_pos, (size_t)context_before);
+    size_t remaining_after = intermediate.length - int_pos - match_len;
+    size_t ctx_after = min(remaining_after, (size_t)context_after);
+    int ctx_ofs = (int)ctx_before;
+    int ctx_len = (int)(ctx_before + match_len + ctx_after);
+
+    FlagRecord rec;
+    view_read(intermediate, int_pos - ctx_before, ctx_len, rec.context);
+
+    string_view match_str(rec.context.data() + ctx_before, match_len);
+    string_view repl;
+    pair_lookup(map, match_str, repl, scratch, &rec.pair);
+
+    // Check if original at sim_pos matches the replacement
+    bool should = false;
+    if (sim_pos + repl.length() <= original.length) {
+      view_read(original, sim_pos, repl.length(), orig_text);
+      should = (orig_text == repl);
+    }
+
+    rec.flag = should ? 1 : 0;
+    rec.ctx_ofs = ctx_ofs;
+    rec.ctx_len = ctx_len;
+    rec.match_len = (int)match_len;
+    rec.pos = int_pos;
+    flags_out.push_back(std::move(rec));
+
+    if (should) {
+      // Update cumulative delta: we're replacing match_len with repl.length()
+      cumulative_delta += (int64_t)repl.length() - (int64_t)match_len;
+      // Skip all matches that start before int_pos + match_len
+      next_valid_int_pos = int_end;
+    }
+  }
+}
+
+// Segment mode (%segment marker): flags are grouped by segments of the
+// buffer they are read from, each starting at an occurrence of the marker
+// (e.g. "\n{{" for enwik articles). The first flag position of a segment
+// gets a header: 0 = flags follow one per match, 1 = all matches take the
+// value of the next flag except for a list of exceptions (Elias-gamma coded
+// count, then gaps). Header and exception bits are passed to the API with
+// the context of the segment's first match and a match length of 0.
+
+// Positions of the marker in v
+static void segment_starts(const PieceView& v, const string& marker, vector<size_t>& out) {
+  out.clear();
+  scan_windows(v, marker.length(), [&](string_view window, size_t at, size_t from, size_t to) {
+    for (size_t p = window.find(marker, from); p < to; p = window.find(marker, p + 1)) out.push_back(at + p);
+  });
+}
+
+// Segment number of a position: markers at or before it
+static size_t segment_of(const vector<size_t>& starts, size_t pos) {
+  return upper_bound(starts.begin(), starts.end(), pos) - starts.begin();
+}
+
+// Bits of the Elias-gamma code of v >= 1
+static void gamma_bits(size_t v, vector<int>& bits) {
+  int n = 0;
+  while ((v >> n) > 1) n++;
+  for (int i = 0; i < n; i++) bits.push_back(0);
+  for (int i = n; i >= 0; i--) bits.push_back((v >> i) & 1);
+}
+
+// Replace per-match flags by segment headers where that takes fewer flags
+static void segment_flags(const ParsedConfig& cfg, const PieceView& v, vector<FlagRecord>& flags) {
+  vector<size_t> starts;
+  vector<FlagRecord> out;
+  qword uniform = 0, segments = 0;
+  segment_starts(v, cfg.segment, starts);
+
+  for (size_t i = 0, j; i < flags.size(); i = j) {
+    size_t seg = segment_of(starts, flags[i].pos);
+    size_t ones = 0;
+    for (j = i; j < flags.size() && segment_of(starts, flags[j].pos) == seg; j++) ones += flags[j].flag;
+
+    // Majority value and exceptions
+    int m = ones * 2 > j - i;
+    vector<int> bits = {1, m};
+    vector<size_t> exceptions;
+    for (size_t k = i; k < j; k++) {
+      if (flags[k].flag != m) exceptions.push_back(k - i);
+    }
+    gamma_bits(exceptions.size() + 1, bits);
+    size_t prev = 0;  // index after the previous exception
+    for (size_t x : exceptions) {
+      gamma_bits(x + 1 - prev, bits);
+      prev = x + 1;
+    }
+
+    FlagRecord hdr = flags[i];
+    hdr.match_len = 0;
+    hdr.features.pair = -1;
+    segments++;
+    if (bits.size() < j - i + 1) {
+      uniform++;
+      for (int b : bits) {
+        hdr.flag = b;
+        out.push_back(hdr);
+      }
+    } else {
+      hdr.flag = 0;
+      out.push_back(hdr);
+      for (size_t k = i; k < j; k++) out.push_back(std::move(flags[k]));
+    }
+  }
+
+  if (!quiet) fprintf(stderr, "Config %s: %llu segments, %llu in segment mode, %llu -> %llu flags\n", cfg.name.c_str(),
+          segments, uniform, (qword)flags.size(), (qword)out.size());
+  flags = std::move(out);
+}
+
+// Word hashes around flag positions (FlagFeatures). The view is tokenized
+// in order, keeping only the words near the current position. Long gaps
+// between flags are skipped: tokenizing may restart after any non-word
+// byte, as long as FEATURE_WORDS words are still read before the flag.
+// The stream also restarts if a position is lower than the one before.
+struct WordStream {
+  struct Word {
+    size_t start, end;
+    uint64_t hash;
+  };
+  const PieceView* v;
+  string chunk;                   // v[chunk_at, chunk_at + chunk.size())
+  size_t chunk_at = 0;
+  size_t next = 0;                // next position to tokenize
+  size_t word_start = SIZE_MAX;   // start of the word being read
+  uint64_t word_hash = 0;
+  deque<Word> words;              // complete words in order
+  size_t last = 0;                // position of the previous call
+
+  static const size_t FEATURE_SKIP = 1 << 10;  // gap worth skipping
+  static const size_t FEATURE_BACK = 1 << 8;   // bytes read before pos after a skip
+
+  explicit WordStream(const PieceView& view) : v(&view) {}
+
+  void restart(size_t at) {
+    next = at;
+    word_start = SIZE_MAX;
+    words.clear();
+    chunk.clear();
+  }
+
+  // Skip to a word boundary shortly before pos; keeps the stream if fewer
+  // than FEATURE_WORDS words end between it and pos
+  void skip_to(size_t pos) {
+    string back;
+    size_t at = pos - FEATURE_BACK;
+    view_read(*v, at, FEATURE_BACK, back);
+    size_t i = 0;
+    while (i < back.size() && word_byte(back[i])) i++;
+    if (i == back.size()) return;
+
+    WordStream s(*v);
+    s.restart(at + i + 1);
+    while (s.next_word() && s.words.back().end <= pos) {}
+    size_t ready = 0;
+    while (ready < s.words.size() && s.words[ready].end <= pos) ready++;
+    if (ready < FEATURE_WORDS) return;
+    s.last = last;
+    *this = std::move(s);
+  }
+
+  static bool word_byte(byte c) {
+    return (c >= '0' && c <= '9') || ((c | 32) >= 'a' && (c | 32) <= 'z') || c >= 0x80;
+  }
+
+  // Tokenize up to the end of the next word; false at the end of the view
+  bool next_word() {
+    static const struct Table {
+      bool word[256];
+      Table() {
+        for (int c = 0; c < 256; c++) word[c] = word_byte((byte)c);
+      }
+    } table;
+
+    while (next < v->length) {
+      if (next >= chunk_at + chunk.size()) {
+        chunk_at = next;
+        view_read(*v, next, min((size_t)1 << 16, v->length - next), chunk);
+      }
+      const byte* p = (const byte*)chunk.data();
+      for (size_t i = next - chunk_at, n = chunk.size(); i < n; i++) {
+        if (table.word[p[i]]) {
+          if (word_start == SIZE_MAX) {
+            word_start = chunk_at + i;
+            word_hash = 0;
+          }
+          word_hash = word_hash_step(word_hash, p[i]);
+        } else if (word_start != SIZE_MAX) {
+          words.push_back({word_start, chunk_at + i, word_hash});
+          word_start = SIZE_MAX;
+          next = chunk_at + i + 1;
+          return true;
+        }
+      }
+      next = chunk_at + chunk.size();
+    }
+    if (word_start == SIZE_MAX) return false;
+    words.push_back({word_start, next, word_hash});
+    word_start = SIZE_MAX;
+    return true;
+  }
+
+  // Features of a flag at match [pos, pos + len); starts are the document
+  // starts (segment markers)
+  void features(size_t pos, size_t len, int pair, const vector<size_t>& starts, FlagFeatures& f) {
+    if (pos < last) restart(0);
+    last = pos;
+    size_t end = pos + len;
+    if (pos > next + FEATURE_SKIP) skip_to(pos);
+
+    // Keep FEATURE_WORDS words ending before pos, read words after end
+    size_t after, before = 0;
+    for (;;) {
+      while (words.size() > FEATURE_WORDS && words[FEATURE_WORDS].end <= pos) words.pop_front();
+      after = 0;
+      while (after < words.size() && words[words.size() - 1 - after].start >= end) after++;
+      if (after >= FEATURE_WORDS || !next_word()) break;
+    }
+    while (before < words.size() && words[before].end <= pos) before++;
+    size_t first_after = words.size() - after;
+
+    size_t s = segment_of(starts, pos);
+    f.pair = pair;
+    f.pos = pos;
+    f.doc = s ? pos - starts[s - 1] : pos;
+    uint64_t h = 0;
+    for (int k = 0; k < FEATURE_WORDS; k++) {
+      h = k < (int)before ? (h ^ words[before - 1 - k].hash) * WORD_HASH_MUL + k + 1 : 0;
+      f.before[k] = h;
+    }
+    h = 0;
+    for (int k = 0; k < FEATURE_WORDS; k++) {
+      h = k < (int)after ? (h ^ words[first_after + k].hash) * WORD_HASH_MUL + k + 1 : 0;
+      f.after[k] = h;
+    }
+  }
+};
+
+// Implied pairs: a pair whose backward matches all got the same flag on
+// this input restores (or keeps) them without flags. The flags of a config
+// with at least HEADER_MIN_MATCHES backward matches start with a header:
+// 0, or 1 1 followed by the pairs implied to restore and then those
+// implied to keep, each list as an Elias-gamma coded count and gaps of
+// pair indexes (1 0 is escape mode, see escape_output). A pair is listed
+// only if it saves more flags than its gap takes. Header flags are passed
+// with the context of position 0 and a match length of 0. Smaller configs
+// have no header: both sides count the matches before any flag, so a
+// config that gains nothing from a header does not pay for one.
+static const size_t HEADER_MIN_MATCHES = 256;
+
+// Append header flag records at the start of v to out
+static void header_records(const PieceView& v, const vector<int>& bits, vector<FlagRecord>& out) {
+  FlagRecord rec;
+  size_t len = min(v.length, (size_t)context_after);
+  view_read(v, 0, len, rec.context);
+  rec.ctx_ofs = 0;
+  rec.ctx_len = (int)len;
+  rec.match_len = 0;
+  if (API_FEATURES) WordStream(v).features(0, 0, -1, {}, rec.features);
+  for (int b : bits) {
+    rec.flag = b;
+    out.push_back(rec);
+  }
+}
+
+static size_t gamma_length(size_t v) {
+  size_t n = 0;
+  while ((v >> n) > 1) n++;
+  return 2 * n + 1;
+}
+
+// Drop the flags of implied pairs; header receives the header flags
+static void imply_pairs(const ParsedConfig& cfg, const PieceView& v, vector<FlagRecord>& flags,
+                        vector<FlagRecord>& header) {
+  size_t npairs = cfg.pairs.size();
+  vector<size_t> count(npairs, 0), ones(npairs, 0);
+  for (const FlagRecord& rec : flags) {
+    if (rec.pair >= npairs) continue;
+    count[rec.pair]++;
+    ones[rec.pair] += rec.flag;
+  }
+
+  vector<int> bits = {1, 1};
+  vector<int> implied(npairs, -1);  // implied flag per pair
+  size_t saved = 0, listed = 0;
+  for (int value = 1; value >= 0; value--) {
+    vector<size_t> list;
+    size_t prev = 0;  // index after the previous listed pair
+    for (size_t p = 0; p < npairs; p++) {
+      if (!count[p] || ones[p] != (value ? count[p] : 0)) continue;
+      if (count[p] <= gamma_length(p + 1 - prev)) continue;
+      list.push_back(p);
+      prev = p + 1;
+    }
+    gamma_bits(list.size() + 1, bits);
+    prev = 0;
+    for (size_t p : list) {
+      gamma_bits(p + 1 - prev, bits);
+      prev = p + 1;
+      implied[p] = value;
+      saved += count[p];
+    }
+    listed += list.size();
+  }
+
+  header.clear();
+  if (!listed || bits.size() >= saved + 1) {
+    header_records(v, {0}, header);
+    return;
+  }
+  header_records(v, bits, header);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < flags.size(); i++) {
+    if (flags[i].pair < npairs && implied[flags[i].pair] >= 0) continue;
+    if (kept != i) flags[kept] = std::move(flags[i]);
+    kept++;
+  }
+  flags.resize(kept);
+  if (!quiet) fprintf(stderr, "Config %s: %llu pairs without flags, %llu flags saved\n", cfg.name.c_str(), (qword)listed,
+          (qword)saved);
+}
+
+// Final flags of a config from compute_flags: implied pairs, segments, header
+// (if the config has enough backward matches, see HEADER_MIN_MATCHES)
+static void finish_flags(const ParsedConfig& cfg, const PieceView& intermediate, size_t matches,
+                         vector<FlagRecord>& flags) {
+  if (API_FEATURES) {
+    WordStream words(intermediate);
+    vector<size_t> starts;
+    if (!cfg.segment.empty()) segment_starts(intermediate, cfg.segment, starts);
+    for (FlagRecord& rec : flags) words.features(rec.pos, rec.match_len, (int)rec.pair, starts, rec.features);
+  }
+
+  vector<FlagRecord> header;
+  if (matches >= HEADER_MIN_MATCHES) imply_pairs(cfg, intermediate, flags, header);
+  if (!cfg.segment.empty()) segment_flags(cfg, intermediate, flags);
+  flags.insert(flags.begin(), header.begin(), header.end());
+}
+
+// Escape mode: a config that keeps few of its backward matches marks them
+// in its output instead of passing a flag for every match. The marker is a
+// byte absent from the output (failing that, a pair of distinct bytes),
+// inserted before each kept match and stored at the end of the output,
+// followed by its length. The flags are only the header 1 0, so the output
+// needs HEADER_MIN_MATCHES backward matches. repl2 picks it when the
+// markers are estimated to take fewer bits than the flags (order-0
+// entropy); configs of fused groups always use flags.
+
+// Marker absent from v: a free byte, else a free pair of distinct bytes
+static bool escape_marker(const PieceView& v, string& marker) {
+  vector<bool> bytes(256, false), pairs(65536, false);
+  scan_windows(v, 1, [&](string_view window, size_t at, size_t from, size_t to) {
+    for (size_t p = from; p < to; p++) {
+      byte c = window[p];
+      bytes[c] = true;
+      if (p + 1 < window.size()) pairs[c << 8 | (byte)window[p + 1]] = true;
+    }
+  });
+  for (int c = 0; c < 256; c++) {
+    if (!bytes[c]) {
+      marker.assign(1, (char)c);
+      return true;
+    }
+  }
+  for (int p = 0; p < 65536; p++) {
+    if (!pairs[p] && p >> 8 != (p & 255)) {
+      marker = {(char)(p >> 8), (char)(p & 255)};
+      return true;
+    }
+  }
+  return false;
+}
+
+// Estimated coded size of flags in bits
+static double flag_bits(const vector<FlagRecord>& flags) {
+  double n = flags.size(), ones = 0;
+  for (const FlagRecord& rec : flags) ones += rec.flag;
+  if (ones == 0 || ones == n) return 0;
+  return -ones * log2(ones / n) - (n - ones) * log2((n - ones) / n);
+}
+
+// Switch a config to escape mode if that is cheaper than its flags; kept
+// holds the positions of its kept matches in intermediate
+static bool escape_output(const ParsedConfig& cfg, KeyMatcher& bwd, PieceStore& store, PieceView& intermediate,
+                          const vector<size_t>& kept, vector<FlagRecord>& flags) {
+  string marker;
+  if (!escape_marker(intermediate, marker)) return false;
+  double bits = 8.0 * (kept.size() + 1) * marker.length() + 8 + 2;
+  if (bits >= flag_bits(flags)) return false;
+
+  vector<Edit> edits;
+  size_t text = store.added.length();
+  store.added += marker;
+  store.added += (char)marker.length();
+  for (size_t pos : kept) edits.push_back({pos, 0, marker.length(), text});
+  edits.push_back({intermediate.length, 0, marker.length() + 1, text});
+  PieceView output;
+  view_apply(intermediate, edits, output);
+
+  // The decoder looks for the header only if the markers leave enough matches
+  vector<pair<size_t, size_t>> matches;
+  collect_matches(cfg, bwd, output, matches);
+  if (matches.size() < HEADER_MIN_MATCHES) {
+    store.added.resize(text);
+    return false;
+  }
+  intermediate = std::move(output);
+
+  if (!quiet) fprintf(stderr, "Config %s: escape mode, %llu kept matches marked, %llu flags saved\n", cfg.name.c_str(),
+          (qword)kept.size(), (qword)flags.size() - 2);
+  flags.clear();
+  header_records(intermediate, {1, 0}, flags);
+  return true;
+}
+
+// Run a transform stage on a view; its output becomes the new store base
+static qword stage_view(const ParsedConfig& cfg, int op, PieceStore& store, const PieceView& input, PieceView& output,
+                        vector<FlagRecord>* flags) {
+  StageHost host;
+  string in;
+  host.flags = flags;
+  host.flag_count = 0;
+  view_read(input, 0, input.length, in);
+  token_index_release(store.base);
+  store.added.clear();
+  string out;
+  run_stage(cfg, op, in, out, host);
+  store.own(std::move(out));
+  view_flat(store, output);
+  return host.flag_count;
+}
+
+// Compress with a single config, in escape mode if escapable and cheaper
+// Returns flags in flags_out and the output as edits of original in intermediate
+void compress_single(const ParsedConfig& cfg, PieceStore& store, const PieceView& original, PieceView& intermediate,
+                     vector<FlagRecord>& flags_out, bool escapable) {
+  KeyMatcher own_fwd, own_bwd;
+  size_t offset, start, end;
+
+  if (cfg.stage_fn) {
+    stage_view(cfg, STAGE_FORWARD, store, original, intermediate, &flags_out);
+    return;
+  }
+
+  if (cfg.pairs.empty()) fail("No replacement pairs found in config %s", cfg.name.c_str());
+
+  // Build forward regex and map
+  KeyMatcher& fwd = use_matcher(cfg, false, own_fwd);
+  if (!quiet) fprintf(stderr, "Config %s: %s kernel\n", cfg.name.c_str(), kernel_names[fwd.kernel]);
+  size_t ahead = view_margin(cfg);
+
+  // Forward replacement, recorded as edits. Windows may point into
+  // store.added, so the replacement texts go to store.added only after the
+  // scan.
+  vector<Edit> edits;
+  string texts;
+  size_t next = 0;  // view position where the next match may start
+
+  scan_windows(original, ahead, [&](string_view window, size_t at, size_t from, size_t to) {
+    offset = max(from, next > at ? next - at : 0);
+    while (find_match(fwd, window, offset, start, end) && start < to) {
+      string_view match_str(window.data() + start, end - start);
+      string_view repl;
+      pair_lookup(fwd.map, match_str, repl, fwd.scratch);
+      edits.push_back({at + start, end - start, repl.length(), texts.length()});
+      texts.append(repl.data(), repl.length());
+
+      offset = end;
+      if (offset == start)
+        offset++;
+      next = at + offset;
+    }
+  });
+  for (Edit& e : edits) e.text += store.added.length();
+  store.added += texts;
+
+  free_matcher(own_fwd);
+  view_apply(original, edits, intermediate);
+
+  // Build backward regex and map
+  KeyMatcher& bwd = use_matcher(cfg, true, own_bwd);
+
+  // Pass 1: Collect all matches in intermediate
+  vector<pair<size_t, size_t>> matches;
+  collect_matches(cfg, bwd, intermediate, matches);
+
+  // Pass 2: Process matches and compute flags (store in flags_out)
+  compute_flags(bwd.map, bwd.scratch, original, intermediate, matches, flags_out);
+  vector<size_t> kept;
+  for (const FlagRecord& rec : flags_out) {
+    if (!rec.flag) kept.push_back(rec.pos);
+  }
+  finish_flags(cfg, intermediate, matches.size(), flags_out);
+  if (escapable && matches.size() >= HEADER_MIN_MATCHES)
+    escape_output(cfg, bwd, store, intermediate, kept, flags_out);
+
+  free_matcher(own_bwd);
+}
+
+// Read the flag of a backward match from the API, with its context
+// (segment-level flags pass a match length of 0)
+// Returns 0/1, or -1 at the end of the flags
+static int read_flag(const PieceView& data, size_t pos, size_t match_len, string& context, bool segment_level = false) {
+  size_t ctx_before = min(pos, (size_t)context_before);
+  size_t remaining_after = data.length - pos - match_len;
+  size_t ctx_after = min(remaining_after, (size_t)context_after);
+  int ctx_ofs = (int)ctx_before;
+  int ctx_len = (int)(ctx_before + match_len + ctx_after);
+  const char* ctx = view_span(data, pos - ctx_before, ctx_len, context);
+  return API(-3, ctx, ctx_ofs, ctx_len, segment_level ? 0 : (int)match_len);
+}
+
+// Record the replacements of sorted matches in v as edits
+static void make_edits(const PieceView& v, PieceStore& store, KeyMatcher& km,
+                       const vector<pair<size_t, size_t>>& matches, vector<Edit>& edits) {
+  string text;
+  for (auto& m : matches) {
+    string_view repl;
+    view_read(v, m.first, m.second - m.first, text);
+    pair_lookup(km.map, text, repl, km.scratch);
+    edits.push_back({m.first, m.second - m.first, repl.length(), store.added.length()});
+    store.added.append(repl.data(), repl.length());
+  }
+}
+
+// Flags of one config in decompression order, with segment headers
+// decoded in segment mode (see segment_flags)
+struct FlagReader {
+  const PieceView* data;
+  bool segmented = false;
+  vector<size_t> starts;  // segment markers
+  size_t seg = SIZE_MAX;  // current segment
+  bool uniform = false;   // current segment has one value
+  int value = 0;
+  vector<size_t> exceptions;
+  size_t index = 0;       // flag index within the segment
+  size_t next_exception = 0;
+  qword count = 0;        // flags read from the API
+  string context;
+  WordStream words;       // for API_FEATURES
+
+  FlagReader(const ParsedConfig& cfg, const PieceView& v) : data(&v), words(v) {
+    segmented = !cfg.segment.empty();
+    if (segmented) segment_starts(v, cfg.segment, starts);
+  }
+
+  // Header: implied flags per pair (see imply_pairs), -1 if none
+  // Returns false for a config in escape mode (see escape_output)
+  bool read_header(vector<int>& implied) {
+    if (bit(0, 0, true) != 1) return true;
+    int mode = bit(0, 0, true);
+    if (mode == 0) return false;
+    if (mode == -1) return true;
+    for (int value = 1; value >= 0; value--) {
+      size_t n = gamma(0, 0);
+      size_t prev = 0;
+      for (size_t e = 1; e < n; e++) {
+        size_t g = gamma(0, 0);
+        if (g == 0 || prev + g - 1 >= implied.size()) return true;
+        implied[prev + g - 1] = value;
+        prev += g;
+      }
+    }
+    return true;
+  }
+
+  int bit(size_t pos, size_t len, bool segment_level, int pair = -1) {
+    if (API_FEATURES) {
+      FlagFeatures f;
+      words.features(pos, len, segment_level ? -1 : pair, starts, f);
+      f.config = feature_config;
+      API_FEATURES(&f);
+    }
+    int c = read_flag(*data, pos, len, context, segment_level);
+    if (c != -1) count++;
+    return c;
+  }
+
+  // Elias-gamma value, 0 at the end of the flags
+  size_t gamma(size_t pos, size_t len) {
+    int n = 0, c;
+    while ((c = bit(pos, len, true)) == 0) n++;
+    if (c == -1) return 0;
+    size_t v = 1;
+    for (int i = 0; i < n; i++) {
+      if ((c = bit(pos, len, true)) == -1) return 0;
+      v = v << 1 | c;
+    }
+    return v;
+  }
+
+  // Flag of the match at pos restored by pair: 0/1, or -1 at the end of the flags
+  int next(size_t pos, size_t len, int pair) {
+    if (!segmented) return bit(pos, len, false, pair);
+
+    size_t s = segment_of(starts, pos);
+    if (s != seg) {
+      seg = s;
+      index = 0;
+      next_exception = 0;
+      exceptions.clear();
+      int h = bit(pos, len, true);
+      uniform = h == 1;
+      if (uniform) {
+        value = bit(pos, len, true);
+        size_t n = gamma(pos, len);
+        if (value == -1 || n == 0) return -1;
+        size_t prev = 0;
+        for (size_t e = 1; e < n; e++) {
+          size_t g = gamma(pos, len);
+          if (g == 0) return -1;
+          exceptions.push_back(prev + g - 1);
+          prev += g;
+        }
+      }
+    }
+
+    if (!uniform) return bit(pos, len, false, pair);
+    int c = value;
+    if (next_exception < exceptions.size() && exceptions[next_exception] == index) {
+      c ^= 1;
+      next_exception++;
+    }
+    index++;
+    return c;
+  }
+};
+
+// Phase 2 of decompression: read the flags of the candidates in order,
+// skipping those inside an earlier replacement; matches of implied pairs
+// take their flag from the header. The contexts come from the un-restored
+// data, so only this skipping depends on the flags.
+static void resolve_flags(FlagReader& reader, const vector<int>& implied, KeyMatcher& km, const PieceView& data,
+                          const vector<pair<size_t, size_t>>& matches, vector<pair<size_t, size_t>>& replaced) {
+  bool any_implied = false;
+  string text;
+  size_t last_end = 0;
+
+  for (int b : implied) any_implied |= b >= 0;
+
+  for (auto& m : matches) {
+    if (m.first < last_end) continue;
+    int c = -1;
+    size_t p = SIZE_MAX;
+    if (any_implied || API_FEATURES) {
+      string_view repl;
+      view_read(data, m.first, m.second - m.first, text);
+      pair_lookup(km.map, text, repl, km.scratch, &p);
+      if (p < implied.size()) c = implied[p];
+    }
+    if (c == -1) c = reader.next(m.first, m.second - m.first, (int)p);
+    if (c != 1) continue;
+    replaced.push_back(m);
+    last_end = m.second;
+  }
+}
+
+// Undo a config in escape mode (see escape_output): remove the markers,
+// then restore every match that does not follow one
+static void decompress_escaped(const ParsedConfig& cfg, KeyMatcher& bwd, PieceStore& store, PieceView& data) {
+  string marker;
+  size_t mlen = 0;
+  if (data.length) {
+    view_read(data, data.length - 1, 1, marker);
+    mlen = (byte)marker[0];
+  }
+  if (mlen < 1 || mlen > 2 || data.length < mlen + 1) {
+    fail("Config %s: missing escape marker (data or flags do not match the configs)", cfg.name.c_str());
+  }
+  size_t end = data.length - mlen - 1;
+  view_read(data, end, mlen, marker);
+
+  // Marker removal; marked holds the positions after each marker
+  vector<Edit> strip;
+  vector<size_t> marked;
+  scan_windows(data, mlen, [&](string_view window, size_t at, size_t from, size_t to) {
+    for (size_t p = window.find(marker, from); p < to && at + p < end; p = window.find(marker, p + mlen)) {
+      marked.push_back(at + p - strip.size() * mlen);
+      strip.push_back({at + p, mlen, 0, 0});
+    }
+  });
+  strip.push_back({end, mlen + 1, 0, 0});
+  PieceView plain;
+  view_apply(data, strip, plain);
+
+  vector<pair<size_t, size_t>> matches, replaced;
+  collect_matches(cfg, bwd, plain, matches);
+  size_t last_end = 0;
+  for (auto& m : matches) {
+    if (m.first < last_end || binary_search(marked.begin(), marked.end(), m.first)) continue;
+    replaced.push_back(m);
+    last_end = m.second;
+  }
+
+  vector<Edit> edits;
+  make_edits(plain, store, bwd, replaced, edits);
+  view_apply(plain, edits, data);
+}
+
+// Decompress with a single config
+// Reads flags from API, replaces data by a view with the restored text
+// Returns the number of flags consumed
+qword decompress_single(const ParsedConfig& cfg, PieceStore& store, PieceView& data, bool escapable) {
+  KeyMatcher own;
+
+  if (cfg.stage_fn) {
+    PieceView output;
+    qword flag_count = stage_view(cfg, STAGE_BACKWARD, store, data, output, nullptr);
+    data = std::move(output);
+    return flag_count;
+  }
+
+  if (cfg.pairs.empty()) fail("No replacement pairs found in config %s", cfg.name.c_str());
+
+  // Phase 1: all candidate matches (in parallel)
+  KeyMatcher& bwd = use_matcher(cfg, true, own);
+  vector<pair<size_t, size_t>> matches;
+  collect_matches(cfg, bwd, data, matches);
+
+  FlagReader reader(cfg, data);
+  vector<int> implied(cfg.pairs.size(), -1);
+  if (matches.size() >= HEADER_MIN_MATCHES && !reader.read_header(implied) && escapable) {
+    decompress_escaped(cfg, bwd, store, data);
+    free_matcher(own);
+    return reader.count;
+  }
+
+  // Phase 2: flags, in order
+  vector<pair<size_t, size_t>> replaced;
+  vector<Edit> edits;
+  resolve_flags(reader, implied, bwd, data, matches, replaced);
+  make_edits(data, store, bwd, replaced, edits);
+  free_matcher(own);
+
+  PieceView output;
+  view_apply(data, edits, output);
+  data = std::move(output);
+  return reader.count;
+}
+
+// Fused scanning: consecutive configs whose matches can neither overlap
+// nor change each other's lb/la decisions are scanned together. Their
+// matches come out of one pass over a trie of all their keys, tagged with
+// config ids, and are mapped into each config's own buffer; buffers,
+// contexts and flags are the same as with one config after another.
+
+static bool fusion_enabled = true;
+
+// What a config touches, for the interaction analysis
+struct FusionInfo {
+  string why;          // set if the config cannot be fused at all
+  Boundary lb, la;
+  bool bytes[256];     // bytes of keys and values (all case variants)
+  bool word_aligned;   // lb == la == [^...] and every key/value starts and ends with a word byte
+  bool word[256];
+  unordered_set<string> tokens;  // lowercased words of keys and values
+};
+
+static void fusion_info(const ParsedConfig& cfg, FusionInfo& fi) {
+  memset(fi.bytes, 0, sizeof(fi.bytes));
+  fi.word_aligned = cfg.lb == cfg.la && parse_word_class(cfg.lb, fi.word);
+  if (cfg.stage_fn) {
+    fi.why = "transform stage";
+    return;
+  }
+  if (cfg.pairs.empty()) {
+    fi.why = "no replacement pairs";
+    return;
+  }
+  if (!parse_boundary(cfg.lb, fi.lb) || !parse_boundary(cfg.la, fi.la)) {
+    fi.why = "lb/la is not a byte class";
+    return;
+  }
+  for (const ReplacementPair& rp : cfg.pairs) {
+    if (rp.from.empty() || rp.to.empty()) {
+      fi.why = "empty key or value";
+      return;
+    }
+    for (int cls = 0; cls < (rp.fold ? 3 : 1); cls++) {
+      for (const string* text : {&rp.from, &rp.to}) {
+        string v = case_variant(*text, cls);
+        for (char c : v) fi.bytes[(byte)c] = true;
+        if (!fi.word_aligned) continue;
+        if (!fi.word[(byte)v[0]] || !fi.word[(byte)v.back()]) {
+          fi.word_aligned = false;
+          continue;
+        }
+        for (size_t i = 0; i < v.length();) {
+          size_t j = i;
+          while (j < v.length() && fi.word[(byte)v[j]]) j++;
+          if (j > i) fi.tokens.insert(ascii_lower(string_view(v).substr(i, j - i)));
+          i = j + 1;
+        }
+      }
+    }
+  }
+}
+
+static string byte_name(int c) {
+  char buf[16];
+  if (c > ' ' && c < 127) snprintf(buf, sizeof(buf), "'%c'", c);
+  else snprintf(buf, sizeof(buf), "0x%02X", c);
+  return buf;
+}
+
+// True if lb/la of a decide the same for every byte that b may write
+static bool boundary_blind(const Boundary& bd, const bool bytes[256]) {
+  if (bd.any) return true;
+  int seen = -1;
+  for (int c = 0; c < 256; c++) {
+    if (!bytes[c]) continue;
+    if (seen >= 0 && seen != (int)bd.ok[c]) return false;
+    seen = bd.ok[c];
+  }
+  return true;
+}
+
+// Can a and b be applied in one scan? Word-aligned configs with the same
+// word class only need disjoint words; otherwise their bytes must be
+// disjoint and invisible to the other's lb/la.
+static bool fusion_compatible(const FusionInfo& a, const FusionInfo& b, string& why) {
+  if (a.word_aligned && b.word_aligned && !memcmp(a.word, b.word, sizeof(a.word))) {
+    const FusionInfo& small = a.tokens.size() < b.tokens.size() ? a : b;
+    const FusionInfo& big = &small == &a ? b : a;
+    for (const string& t : small.tokens) {
+      if (big.tokens.count(t)) {
+        why = "shares word '" + t + "'";
+        return false;
+      }
+    }
+    return true;
+  }
+  for (int c = 0; c < 256; c++) {
+    if (a.bytes[c] && b.bytes[c]) {
+      why = a.word_aligned && b.word_aligned ? "different word class" : "shares byte " + byte_name(c);
+      return false;
+    }
+  }
+  if (!boundary_blind(a.lb, b.bytes) || !boundary_blind(a.la, b.bytes) ||
+      !boundary_blind(b.lb, a.bytes) || !boundary_blind(b.la, a.bytes)) {
+    why = "lb/la depends on bytes the other writes";
+    return false;
+  }
+  return true;
+}
+
+// Split configs into runs of consecutive fusable configs (at most 64 each)
+// and report the configs that could not join the run before them
+static vector<pair<size_t, size_t>> fusion_groups(const vector<ParsedConfig>& configs, bool report) {
+  vector<pair<size_t, size_t>> groups;
+  if (configs.size() < 2) {
+    for (size_t i = 0; i < configs.size(); i++) groups.push_back({i, 1});
+    return groups;
+  }
+
+  vector<FusionInfo> info(configs.size());
+  for (size_t i = 0; i < configs.size(); i++) fusion_info(configs[i], info[i]);
+
+  for (size_t i = 0; i < configs.size(); i++) {
+    string why = info[i].why;
+    if (why.empty() && !groups.empty()) {
+      size_t first = groups.back().first, count = groups.back().second;
+      if (!info[first].why.empty()) {
+        why = "";  // previous config stands alone
+      } else if (count == 64) {
+        why = "group is full";
+      } else {
+        for (size_t k = first; k < first + count && why.empty(); k++) {
+          if (!fusion_compatible(info[k], info[i], why)) why += " with " + configs[k].name;
+        }
+        if (why.empty()) {
+          groups.back().second++;
+          continue;
+        }
+      }
+    }
+    if (!why.empty() && report) fprintf(stderr, "Not fused: %s (%s)\n", configs[i].name.c_str(), why.c_str());
+    groups.push_back({i, 1});
+  }
+
+  for (auto& g : groups) {
+    if (!report) break;
+    if (g.second < 2) continue;
+    fprintf(stderr, "Fused:");
+    for (size_t k = g.first; k < g.first + g.second; k++) {
+      fprintf(stderr, "%s %s", k == g.first ? "" : " +", configs[k].name.c_str());
+    }
+    fprintf(stderr, "\n");
+  }
+  return groups;
+}
+
+// Configs that may use escape mode: those fusion does not group, with or
+// without -S, so that both give the same output
+static vector<bool> escapable_configs(const vector<ParsedConfig>& configs) {
+  vector<bool> escapable(configs.size(), true);
+  for (auto& group : fusion_groups(configs, false)) {
+    if (group.second < 2) continue;
+    for (size_t k = group.first; k < group.first + group.second; k++) escapable[k] = false;
+  }
+  return escapable;
+}
+
+// Groups scanned together: those of fusion_groups, single configs with -S
+static vector<pair<size_t, size_t>> plan_fusion(const vector<ParsedConfig>& configs) {
+  if (fusion_enabled) return fusion_groups(configs, !quiet);
+  vector<pair<size_t, size_t>> groups;
+  for (size_t i = 0; i < configs.size(); i++) groups.push_back({i, 1});
+  return groups;
+}
+
+// Keys of a fused group in one direction
+struct FusedMatcher {
+  vector<KeyMatcher> km;   // per config: pair map, byte keys, lb/la
+  KeyMatcher all;          // all keys: start filter and trie
+  vector<uint64_t> tags;   // per trie state: configs with a key ending there
+  size_t ahead = 0;        // window margin (view_margin)
+};
+
+static void build_fused(const vector<ParsedConfig>& configs, size_t first, size_t count, bool backward,
+                        FusedMatcher& fm) {
+  fm.km = vector<KeyMatcher>(count);
+  KeyMatcher& all = fm.all;
+  all.lb.any = false;
+  memset(all.lb.ok, 0, sizeof(all.lb.ok));
+  for (size_t g = 0; g < count; g++) {
+    KeyMatcher& km = fm.km[g];
+    build_pair_map(configs[first + g].pairs, backward, km.map);
+    byte_kernel_usable(configs[first + g], km);
+    fm.ahead = max(fm.ahead, view_margin(configs[first + g]));
+    all.byte_keys.insert(all.byte_keys.end(), km.byte_keys.begin(), km.byte_keys.end());
+    all.lb.any |= km.lb.any;
+    for (int c = 0; c < 256; c++) all.lb.ok[c] |= km.lb.any || km.lb.ok[c];
+  }
+  sort(all.byte_keys.begin(), all.byte_keys.end());
+  all.byte_keys.erase(unique(all.byte_keys.begin(), all.byte_keys.end()), all.byte_keys.end());
+  for (string_view k : all.byte_keys) all.key_bytes += k.length();
+
+  bool dense = all.key_bytes <= DENSE_MAX_BYTES;
+  build_start_filter(all);
+  build_trie(all, dense);
+
+  const KeyTrie& tr = all.trie;
+  fm.tags.assign(tr.out_len.size(), 0);
+  for (size_t g = 0; g < count; g++) {
+    for (string_view k : fm.km[g].byte_keys) {
+      int32_t s = 0;
+      for (char c : k) s = dense ? tr.delta[s * 256 + (byte)c] : packed_child(tr, s, c);
+      fm.tags[s] |= (uint64_t)1 << g;
+    }
+  }
+}
+
+// Matcher of a fused group: the prebuilt one, else own, built here
+static FusedMatcher& use_fused(const vector<ParsedConfig>& configs, size_t first, size_t count, bool backward,
+                               FusedMatcher& own) {
+  PrebuiltMatchers* pm = configs[first].prebuilt.get();
+  if (pm && pm->group == count && pm->fused[backward]) return *pm->fused[backward];
+  build_fused(configs, first, count, backward, own);
+  return own;
+}
+
+// One pass over a view for a fused group. Per config: the longest key at
+// every start (all_starts, like the backward scan, split over scan_threads
+// threads), or its leftmost non-overlapping matches (like the forward
+// replacement).
+static void fused_scan(const FusedMatcher& fm, const PieceView& v, bool all_starts,
+                       vector<vector<pair<size_t, size_t>>>& out) {
+  const KeyTrie& tr = fm.all.trie;
+  const bool dense = !tr.delta.empty();
+  size_t count = fm.km.size();
+  vector<vector<vector<pair<size_t, size_t>>>> parts(scan_threads, vector<vector<pair<size_t, size_t>>>(count));
+
+  size_t nparts = scan_parallel(v, fm.ahead, all_starts ? scan_threads : 1, [&](size_t t, size_t first, size_t last) {
+    vector<size_t> next_ok(count, 0), ends(count);
+    scan_windows(v, fm.ahead, [&](string_view window, size_t at, size_t from, size_t to) {
+      const byte* p = (const byte*)window.data();
+      size_t n = window.length();
+      for (size_t j = next_start(fm.all, p, from, n); j < to; j = next_start(fm.all, p, j + 1, n)) {
+        uint64_t found = 0;
+        int32_t s = 0;
+        for (size_t i = j; i < n; i++) {
+          s = dense ? tr.delta[s * 256 + p[i]] : packed_child(tr, s, p[i]);
+          if (!s) break;
+          for (uint64_t b = fm.tags[s]; b; b &= b - 1) {
+            int g = ctz64(b);
+            const KeyMatcher& km = fm.km[g];
+            if (!all_starts && at + j < next_ok[g]) continue;
+            if (!lb_accepts(km, p, j) || !la_accepts(km, p, n, i + 1)) continue;
+            ends[g] = i + 1;
+            found |= (uint64_t)1 << g;
+          }
+        }
+        for (; found; found &= found - 1) {
+          int g = ctz64(found);
+          parts[t][g].push_back({at + j, at + ends[g]});
+          if (!all_starts) next_ok[g] = at + ends[g];
+        }
+      }
+    }, first, last);
+  });
+
+  out.assign(count, {});
+  for (size_t g = 0; g < count; g++) {
+    for (size_t t = 0; t < nparts; t++) out[g].insert(out[g].end(), parts[t][g].begin(), parts[t][g].end());
+  }
+}
+
+// Move sorted matches across the edits of one config: from the buffer
+// before it to the one after it (to_after), or back. Matches never overlap
+// the edits of another config in a fused group.
+static void map_matches(vector<pair<size_t, size_t>>& matches, const vector<Edit>& edits, bool to_after) {
+  size_t k = 0;
+  int64_t delta = 0;
+  for (auto& m : matches) {
+    while (k < edits.size()) {
+      size_t pos = to_after ? edits[k].pos : edits[k].pos + delta;
+      size_t len = to_after ? edits[k].old_len : edits[k].new_len;
+      if (pos + len > m.first) break;
+      delta += (int64_t)edits[k].new_len - (int64_t)edits[k].old_len;
+      k++;
+    }
+    int64_t d = to_after ? delta : -delta;
+    m.first += d;
+    m.second += d;
+  }
+}
+
+// Round-trip verification (mode v): while compressing, the input of every
+// config is summed as CRC32C per VERIFY_CHUNK bytes. While decompressing,
+// the result of undoing each config is summed again and compared, so the
+// first divergence is found at the config that caused it, not at the end.
+static const size_t VERIFY_CHUNK = 1 << 12;
+
+struct StageSums {
+  qword length = 0;
+  vector<uint> chunks;
+};
+
+static bool verify_enabled = false;
+static vector<StageSums> verify_sums;  // input of each config
+static bool verify_diverged = false;   // a divergence was reported
+
+// Chunk sums of v, the chunks split over scan_threads threads
+static StageSums view_sums(const PieceView& v) {
+  StageSums sums;
+  sums.length = v.length;
+  sums.chunks.resize((v.length + VERIFY_CHUNK - 1) / VERIFY_CHUNK);
+  size_t parts = max((size_t)1, min((size_t)scan_threads, sums.chunks.size()));
+  auto part = [&](size_t t) {
+    string scratch;
+    for (size_t k = sums.chunks.size() * t / parts; k < sums.chunks.size() * (t + 1) / parts; k++) {
+      size_t pos = k * VERIFY_CHUNK, len = min(VERIFY_CHUNK, v.length - pos);
+      sums.chunks[k] = crc32c(0, view_span(v, pos, len, scratch), len);
+    }
+  };
+  vector<std::thread> pool;
+  for (size_t t = 1; t < parts; t++) pool.emplace_back(part, t);
+  part(0);
+  for (std::thread& th : pool) th.join();
+  return sums;
+}
+
+// Compressing: v is the input of config i
+static void verify_record(size_t i, const PieceView& v) {
+  if (verify_enabled) verify_sums[i] = view_sums(v);
+}
+
+// Decompressing: v should be the input of config i again. Reports the
+// first chunk that differs.
+static void verify_check(const vector<ParsedConfig>& configs, size_t i, const PieceView& v) {
+  if (!verify_enabled || verify_diverged) return;
+  StageSums got = view_sums(v);
+  const StageSums& want = verify_sums[i];
+  size_t k = 0;
+  while (k < got.chunks.size() && k < want.chunks.size() && got.chunks[k] == want.chunks[k]) k++;
+  if (got.length == want.length && k == want.chunks.size()) return;
+  verify_diverged = true;
+  fprintf(stderr, "Divergence: undoing config %llu (%s) gives %llu bytes for its %llu byte input, first "
+          "difference in bytes %llu..%llu\n", (qword)i + 1, configs[i].name.c_str(), got.length, want.length,
+          (qword)(k * VERIFY_CHUNK), min((qword)(k + 1) * VERIFY_CHUNK, max(got.length, want.length)));
+}
+
+// Build the matchers of all configs once, for processes that run many jobs
+// with the same configs (serve and batch build them before forking their
+// workers). Stages and configs without pairs keep building theirs per run.
+static void prebuild_matchers(vector<ParsedConfig>& configs) {
+  auto compile_exact = [](KeyMatcher& km) {
+    if (km.exact_pattern.empty()) return;
+    km.exact_re = compile_pattern(km.exact_pattern);
+    km.exact_md = pcre2_match_data_create_from_pattern(km.exact_re, NULL);
+  };
+  bool report = quiet;
+  quiet = true;  // plan_fusion reports the groups on every run
+  vector<pair<size_t, size_t>> groups = plan_fusion(configs);
+  quiet = report;
+
+  for (auto& group : groups) {
+    ParsedConfig& cfg = configs[group.first];
+    if (cfg.stage_fn || cfg.pairs.empty()) continue;
+    auto pm = make_shared<PrebuiltMatchers>();
+    pm->group = group.second;
+    if (group.second > 1) {
+      for (int backward = 0; backward < 2; backward++) {
+        pm->fused[backward] = make_shared<FusedMatcher>();
+        build_fused(configs, group.first, group.second, backward, *pm->fused[backward]);
+      }
+      cfg.prebuilt = pm;
+      continue;
+    }
+    build_matcher(cfg, false, pm->fwd);
+    compile_exact(pm->fwd);
+    pm->bwd.reserve(scan_threads);  // matchers hold views of themselves, never moved
+    pm->bwd.emplace_back();
+    build_matcher(cfg, true, pm->bwd[0]);
+    if (!matcher_shared(pm->bwd[0])) {
+      pm->bwd.resize(scan_threads);
+      for (size_t t = 1; t < pm->bwd.size(); t++) build_matcher(cfg, true, pm->bwd[t]);
+    }
+    for (KeyMatcher& km : pm->bwd) compile_exact(km);
+    cfg.prebuilt = pm;
+  }
+}
+
+// Compress a fused group: one forward scan of the input and one backward
+// scan of the result serve all its configs
+static void compress_fused(const vector<ParsedConfig>& configs, size_t first, size_t count, PieceStore& store,
+                           PieceView& current, vector<vector<FlagRecord>>& all_flags) {
+  vector<PieceView> views(count + 1);
+  vector<vector<Edit>> edits(count);
+  vector<vector<pair<size_t, size_t>>> matches;
+  FusedMatcher own_fwd, own_bwd;
+
+  // Forward matches of all configs, in coordinates of the group input
+  views[0] = std::move(current);
+  FusedMatcher& fwd = use_fused(configs, first, count, false, own_fwd);
+  fused_scan(fwd, views[0], false, matches);
+
+  for (size_t g = 0; g < count; g++) {
+    verify_record(first + g, views[g]);
+    for (size_t d = 0; d < g; d++) map_matches(matches[g], edits[d], true);
+    make_edits(views[g], store, fwd.km[g], matches[g], edits[g]);
+    view_apply(views[g], edits[g], views[g + 1]);
+  }
+
+  // Backward matches of all configs in the group output, moved back into
+  // each config's own output
+  FusedMatcher& bwd = use_fused(configs, first, count, true, own_bwd);
+  fused_scan(bwd, views[count], true, matches);
+
+  for (size_t g = 0; g < count; g++) {
+    for (size_t d = count - 1; d > g; d--) map_matches(matches[g], edits[d], false);
+    use_model(configs[first + g].model);
+    compute_flags(bwd.km[g].map, bwd.km[g].scratch, views[g], views[g + 1], matches[g], all_flags[first + g]);
+    finish_flags(configs[first + g], views[g + 1], matches[g].size(), all_flags[first + g]);
+    if (!quiet) fprintf(stderr, "Config %s: %llu -> %llu bytes, %llu flags\n", configs[first + g].name.c_str(),
+            (qword)views[g].length, (qword)views[g + 1].length, (qword)all_flags[first + g].size());
+  }
+
+  current = std::move(views[count]);
+}
+
+// Decompress a fused group: one backward scan serves all its configs, each
+// resolved from its flags in reverse order
+static qword decompress_fused(const vector<ParsedConfig>& configs, size_t first, size_t count, PieceStore& store,
+                              PieceView& data) {
+  vector<vector<Edit>> edits(count);
+  vector<vector<pair<size_t, size_t>>> matches;
+  FusedMatcher own;
+  qword total = 0;
+
+  FusedMatcher& bwd = use_fused(configs, first, count, true, own);
+  fused_scan(bwd, data, true, matches);
+
+  for (size_t g = count; g-- > 0;) {
+    for (size_t d = count - 1; d > g; d--) map_matches(matches[g], edits[d], true);
+
+    const ParsedConfig& cfg = configs[first + g];
+    feature_config = (int)(first + g);
+    if (!open_config_flags(cfg, first + g, 1)) fail("Config %s: cannot open its flags", cfg.name.c_str());
+    FlagReader reader(cfg, data);
+    vector<int> implied(cfg.pairs.size(), -1);
+    if (matches[g].size() >= HEADER_MIN_MATCHES) reader.read_header(implied);  // fused configs are not escapable
+    vector<pair<size_t, size_t>> replaced;
+    resolve_flags(reader, implied, bwd.km[g], data, matches[g], replaced);
+    close_config_flags(first + g, 1);
+    qword flag_count = reader.count;
+    make_edits(data, store, bwd.km[g], replaced, edits[g]);
+
+    PieceView output;
+    view_apply(data, edits[g], output);
+    if (!quiet) fprintf(stderr, "Config %s: %llu -> %llu bytes, %llu flags\n", configs[first + g].name.c_str(),
+            (qword)data.length, (qword)output.length, flag_count);
+    total += flag_count;
+    data = std::move(output);
+    verify_check(configs, first + g, data);
+  }
+  return total;
+}
+
+// Flags file of a list with several flag models: "R2MS", the model count
+// (1 byte), the length of each model's segment (8 bytes, little endian),
+// then the segments in model order. Each model codes its segment as a file
+// of its own next to the flags file. A single model writes the flags file
+// directly.
+static const char MODELS_MAGIC[4] = {'R', '2', 'M', 'S'};
+
+static string model_segment_name(const char* flg_file, size_t k) {
+  return string(flg_file) + ".m" + to_string(k);
+}
+
+static void remove_model_segments(const char* flg_file) {
+  for (size_t k = 0; k < flag_models.size(); k++) remove(model_segment_name(flg_file, k).c_str());
+}
+
+// Model snapshots: "R2SS", the model count (1 byte), the length of each
+// model's state (8 bytes, little endian), then the states in model order.
+// Models without API_SAVE store an empty state.
+static const char SNAPSHOT_MAGIC[4] = {'R', '2', 'S', 'S'};
+static const char* snapshot_in = nullptr;   // -w: warm start from this snapshot
+static const char* snapshot_out = nullptr;  // -W: write the final states here
+static string snapshot_data;                // snapshot loaded by every open_flags()
+
+// Restore every model (or only model `only`) from snapshot_data, after
+// API(-1)
+static bool load_snapshot(int only = -1) {
+  if (snapshot_data.empty()) return true;
+  const string& snap = snapshot_data;
+  size_t n = flag_models.size(), pos = 5 + 8 * n;
+  if (snap.length() < pos || memcmp(snap.data(), SNAPSHOT_MAGIC, 4) != 0 || (byte)snap[4] != n) {
+    fprintf(stderr, "Snapshot %s does not hold %llu model states\n", snapshot_in, (qword)n);
+    return false;
+  }
+  for (size_t k = 0; k < n; k++) {
+    qword len = get_u64(snap.data() + 5 + 8 * k);
+    if (len > snap.length() - pos) {
+      fprintf(stderr, "Snapshot %s is truncated\n", snapshot_in);
+      return false;
+    }
+    const FlagModel& m = flag_models[k];
+    bool wanted = len > 0 && (only < 0 || (int)k == only);
+    if (wanted && !m.load) {
+      fprintf(stderr, "Flag model %s cannot load snapshots\n", m.name.c_str());
+      return false;
+    }
+    if (wanted && m.load(snap.data() + pos, (long long)len) != 0) {
+      fprintf(stderr, "Flag model %s rejected snapshot %s\n", m.name.c_str(), snapshot_in);
+      return false;
+    }
+    pos += len;
+  }
+  return true;
+}
+
+// Write the state of every model to snapshot_out, before API(-2)
+static bool save_snapshot() {
+  if (!snapshot_out) return true;
+  size_t n = flag_models.size();
+  vector<string> states(n);
+  string snap(SNAPSHOT_MAGIC, 4);
+  snap += (char)n;
+  for (size_t k = 0; k < n; k++) {
+    const FlagModel& m = flag_models[k];
+    if (m.save) {
+      long long size = m.save(nullptr, 0);
+      if (size > 0) {
+        states[k].resize(size);
+        if (m.save(&states[k][0], size) != size) size = -1;
+      }
+      if (size < 0) {
+        fprintf(stderr, "Flag model %s cannot save its state\n", m.name.c_str());
+        return false;
+      }
+    } else {
+      fprintf(stderr, "Flag model %s has no snapshot support, saving an empty state\n", m.name.c_str());
+    }
+    put_u64(snap, states[k].length());
+  }
+  for (size_t k = 0; k < n; k++) snap += states[k];
+  if (!write_file(snapshot_out, snap)) return false;
+  fprintf(stderr, "Snapshot: %llu bytes\n", (qword)snap.length());
+  return true;
+}
+
+// Flags sessions left open when a run fails, see abort_run
+static size_t flags_open = 0;       // models with an open session (open_flags)
+static string flags_session;        // their flags file
+static bool config_flags_open = false;  // session of open_config_flags
+
+// API(-1) for every model (mode 0 = encode, 1 = decode), splitting the
+// flags file into segments first when decoding
+static bool open_flags(const char* flg_file, int mode) {
+  size_t n = flag_models.size();
+  flags_session = flg_file;
+  if (n == 1) {
+    use_model(0);
+    if (API(-1, flg_file, mode, 0, 0) != 0) return false;
+    flags_open = 1;
+    return load_snapshot();
+  }
+
+  if (mode == 1) {
+    string flags = read_file(flg_file);
+    size_t pos = 5 + 8 * n;
+    if (flags.length() < pos || memcmp(flags.data(), MODELS_MAGIC, 4) != 0 || (byte)flags[4] != n) {
+      fprintf(stderr, "Flags file %s does not hold %llu model segments\n", flg_file, (qword)n);
+      return false;
+    }
+    for (size_t k = 0; k < n; k++) {
+      qword len = get_u64(flags.data() + 5 + 8 * k);
+      if (len > flags.length() - pos) {
+        fprintf(stderr, "Flags file %s is truncated\n", flg_file);
+        remove_model_segments(flg_file);
+        return false;
+      }
+      if (!write_file(model_segment_name(flg_file, k).c_str(), flags.substr(pos, len))) {
+        remove_model_segments(flg_file);
+        return false;
+      }
+      pos += len;
+    }
+  }
+
+  for (size_t k = 0; k < n; k++) {
+    use_model((int)k);
+    if (API(-1, model_segment_name(flg_file, k).c_str(), mode, 0, 0) != 0) {
+      remove_model_segments(flg_file);
+      return false;
+    }
+    flags_open = k + 1;
+  }
+  if (!load_snapshot()) {
+    remove_model_segments(flg_file);
+    return false;
+  }
+  return true;
+}
+
+// API(-2) for every model, joining the segments into the flags file when
+// encoding
+static bool close_flags(const char* flg_file, int mode) {
+  size_t n = flag_models.size();
+  bool ok = save_snapshot();
+  for (size_t k = 0; k < n; k++) {
+    use_model((int)k);
+    API(-2, nullptr, 0, 0, 0);
+  }
+  flags_open = 0;
+  if (n == 1) return ok;
+
+  if (mode == 0) {
+    vector<string> segments(n);
+    string flags(MODELS_MAGIC, 4);
+    flags += (char)n;
+    for (size_t k = 0; k < n; k++) {
+      segments[k] = read_file(model_segment_name(flg_file, k).c_str());
+      put_u64(flags, segments[k].length());
+    }
+    for (size_t k = 0; k < n; k++) flags += segments[k];
+    if (!write_file(flg_file, flags)) ok = false;
+  }
+  remove_model_segments(flg_file);
+  return ok;
+}
+
+// Per-config flag segments (containers): every config codes its flags in a
+// session of its own (API(-1) .. API(-2)) through segment_scratch, and
+// config_segments[i] holds the flags of config i. The shared flags file is
+// not used then.
+static bool per_config_flags = false;
+static vector<string> config_segments;
+static string segment_scratch;
+
+// Select the model of config i, and open its session with per-config
+// segments
+static bool open_config_flags(const ParsedConfig& cfg, size_t i, int mode) {
+  use_model(cfg.model);
+  if (!per_config_flags) return true;
+  if (mode == 1 && !write_file(segment_scratch.c_str(), config_segments[i])) return false;
+  if (API(-1, segment_scratch.c_str(), mode, 0, 0) != 0) return false;
+  config_flags_open = true;
+  return load_snapshot(cfg.model);
+}
+
+static void close_config_flags(size_t i, int mode) {
+  if (!per_config_flags) return;
+  API(-2, nullptr, 0, 0, 0);
+  config_flags_open = false;
+  if (mode == 0) config_segments[i] = read_file(segment_scratch.c_str());
+}
+
+// Undo what a failed run left behind, so that the process can run the next
+// job (serve, batch and the library): open flags sessions and their segment
+// files, verify sums, and the token indexes of buffers that are gone
+static void abort_run() {
+  if (config_flags_open) API(-2, nullptr, 0, 0, 0);  // model still selected
+  config_flags_open = false;
+  for (size_t k = 0; k < flags_open; k++) {
+    use_model((int)k);
+    API(-2, nullptr, 0, 0, 0);
+  }
+  if (flags_open && flag_models.size() > 1) remove_model_segments(flags_session.c_str());
+  flags_open = 0;
+  verify_enabled = false;
+  for (TokenIndex* ti : token_cache) delete ti;
+  token_cache.clear();
+}
+
+// Output sink (library, see repl2lib.h): when set, the result of a run is
+// pushed to it piece by piece straight from the view, and data is left
+// empty
+static void (*output_sink)(void* user, const char* data, size_t len) = nullptr;
+static void* output_sink_user = nullptr;
+
+static void emit_output(const PieceView& v, string& data) {
+  if (!output_sink) {
+    view_read(v, 0, v.length, data);
+    return;
+  }
+  data.clear();
+  for (const Piece& p : v.pieces) {
+    output_sink(output_sink_user, (p.added ? v.store->added : v.store->base).data() + p.ofs, p.len);
+  }
+}
+
+// Cache directory (-C dir): compressed container blocks (s, see
+// mode_seekable) and list prefixes (c, see mode_compress)
+static const char* cache_dir = nullptr;
+static const qword CACHE_VERSION = 2;
+static const char BUILD_ID[] = __DATE__ " " __TIME__;  // engine build, in cache keys
+
+static string cache_path(char kind, qword key, qword hash) {
+  char name[40];
+  snprintf(name, sizeof(name), "/%c%016llX%016llX", kind, key, hash);
+  return string(cache_dir ? cache_dir : ".") + name;
+}
+
+// Write an entry under a temporary name, then rename it, so that a reader
+// never sees half an entry. Failures only cost the entry.
+static void cache_store(const string& path, const string& entry) {
+  string temp = path + ".tmp";
+  if (!write_file(temp.c_str(), entry)) return;
+  remove(path.c_str());
+  if (rename(temp.c_str(), path.c_str()) != 0) remove(temp.c_str());
+}
+
+// Read length bytes at offset of an open file
+static bool read_at(FILE* f, qword offset, qword length, string& out) {
+  out.resize(length);
+  return fseeko64(f, offset, SEEK_SET) == 0 && fread(&out[0], 1, length, f) == length;
+}
+
+static string base_name(const string& path) {
+  size_t k = path.find_last_of("/\\");
+  return k == string::npos ? path : path.substr(k + 1);
+}
+
+// Hash of count configs from first (all by default), kept in containers so
+// that a different config list is caught before decoding: patterns, pairs,
+// segment markers, and stage and flag model names without their directories
+static qword config_hash(const vector<ParsedConfig>& configs, size_t first = 0, size_t count = SIZE_MAX) {
+  qword h = 0xCBF29CE484222325ULL;  // FNV-1a over length-prefixed fields
+  auto mix = [&h](const string& field) {
+    string len;
+    put_u64(len, field.length());
+    for (char c : len + field) h = (h ^ (byte)c) * 0x100000001B3ULL;
+  };
+  count = min(count, configs.size() - first);
+  mix(to_string(count));
+  for (size_t i = first; i < first + count; i++) {
+    const ParsedConfig& cfg = configs[i];
+    mix(cfg.lb);
+    mix(cfg.la);
+    mix(cfg.segment);
+    mix(base_name(cfg.stage));
+    mix(cfg.stage_arg);
+    mix(base_name(cfg.model_name));
+    mix(to_string(cfg.pairs.size()));
+    for (const ReplacementPair& p : cfg.pairs) {
+      mix(p.from);
+      mix(p.to);
+      mix(p.fold ? "1" : "0");
+    }
+  }
+  return h;
+}
+
+// Flag spill file: each config's flags leave memory as soon as the config
+// is done, so compress memory does not grow with the flag count. The flags
+// file wants them in reverse config order, so they go to <flags>.spill in
+// config order and are read back segment by segment, last config first.
+// With per_config_flags they are coded into the config's segment right away
+// instead.
+//
+// Record: varint record length, flag byte, varints ctx_ofs, match_len and
+// context length, the context, then, if the config's model takes features,
+// varints pair + 1, pos and doc and the word hashes (8 bytes each)
+struct FlagSpill {
+  string path;
+  FILE* f = nullptr;
+  string buffer;                            // records not written yet
+  vector<pair<qword, qword>> segments;      // file offset and flag count per config
+  qword offset = 0;                         // file size, with buffer
+  bool keep = false;                        // copy the records of the last config to kept
+  string kept;
+};
+
+static void put_varint(string& s, qword v) {
+  for (; v >= 0x80; v >>= 7) s += (char)(v | 0x80);
+  s += (char)v;
+}
+
+static qword get_varint(const char*& p) {
+  qword v = 0;
+  for (int shift = 0;; shift += 7) {
+    byte c = (byte)*p++;
+    v |= (qword)(c & 0x7F) << shift;
+    if (c < 0x80 || shift >= 63) return v;
+  }
+}
+
+// Spill of the compression in progress, removed by remove_spill
+static FlagSpill* running_spill = nullptr;
+
+static void remove_spill() {
+  FlagSpill* spill = running_spill;
+  if (!spill || !spill->f) return;
+  fclose(spill->f);
+  spill->f = nullptr;
+  remove(spill->path.c_str());
+}
+
+static bool spill_open(FlagSpill& spill) {
+  if (spill.f) return true;
+  spill.f = fopen(spill.path.c_str(), "w+b");
+  if (!spill.f) fprintf(stderr, "Cannot create %s\n", spill.path.c_str());
+  return spill.f != nullptr;
+}
+
+static bool spill_write(FlagSpill& spill) {
+  bool ok = fwrite(spill.buffer.data(), 1, spill.buffer.length(), spill.f) == spill.buffer.length();
+  if (!ok) fprintf(stderr, "Cannot write %s\n", spill.path.c_str());
+  spill.buffer.clear();
+  return ok;
+}
+
+// Move the flags of config i to its segment, code them there with
+// per_config_flags, and release them
+static bool spill_flags(const ParsedConfig& cfg, size_t i, vector<FlagRecord>& flags, FlagSpill& spill) {
+  if (per_config_flags) {
+    if (!open_config_flags(cfg, i, 0)) return false;
+    for (const FlagRecord& rec : flags) {
+      if (API_FEATURES) {
+        FlagFeatures f = rec.features;
+        f.config = (int)i;
+        API_FEATURES(&f);
+      }
+      API(rec.flag, rec.context.c_str(), rec.ctx_ofs, rec.ctx_len, rec.match_len);
+    }
+    close_config_flags(i, 0);
+    vector<FlagRecord>().swap(flags);
+    return true;
+  }
+
+  if (spill.segments.size() <= i) spill.segments.resize(i + 1);
+  spill.segments[i] = {spill.offset, flags.size()};
+  spill.kept.clear();
+  if (!flags.empty() && !spill_open(spill)) return false;
+  use_model(cfg.model);
+  bool features = API_FEATURES != nullptr;
+  string rec_bytes;
+  for (const FlagRecord& rec : flags) {
+    rec_bytes.clear();
+    rec_bytes += (char)rec.flag;
+    put_varint(rec_bytes, rec.ctx_ofs);
+    put_varint(rec_bytes, rec.match_len);
+    put_varint(rec_bytes, rec.context.length());
+    rec_bytes += rec.context;
+    if (features) {
+      put_varint(rec_bytes, (qword)(rec.features.pair + 1));
+      put_varint(rec_bytes, rec.features.pos);
+      put_varint(rec_bytes, rec.features.doc);
+      for (qword h : rec.features.before) put_u64(rec_bytes, h);
+      for (qword h : rec.features.after) put_u64(rec_bytes, h);
+    }
+    size_t before = spill.buffer.length();
+    put_varint(spill.buffer, rec_bytes.length());
+    spill.buffer += rec_bytes;
+    spill.offset += spill.buffer.length() - before;
+    if (spill.keep) spill.kept.append(spill.buffer, before, string::npos);
+    if (spill.buffer.length() >= (1 << 20) && !spill_write(spill)) return false;
+  }
+  vector<FlagRecord>().swap(flags);
+  return true;
+}
+
+// Add count records of config i, as spill_flags() wrote them (prefix cache)
+static bool spill_records(size_t i, const string& records, qword count, FlagSpill& spill) {
+  if (spill.segments.size() <= i) spill.segments.resize(i + 1);
+  spill.segments[i] = {spill.offset, count};
+  if (count > 0 && !spill_open(spill)) return false;
+  spill.buffer += records;
+  spill.offset += records.length();
+  return spill.buffer.length() < (1 << 20) || spill_write(spill);
+}
+
+// Prefix cache (-C dir with c): after a run, config i of the list leaves
+// <dir>/p<input hash><prefix hash>, where the prefix hash covers configs
+// 0..i, their flag model names and whether they may use escape mode (which
+// depends on the configs after them). The entry holds the flag records of
+// config i, and the output after config i if a scan group ends there. A
+// run with the same input and a list that starts with the same configs
+// takes the output of the deepest such entry and the records of the
+// configs up to it from the cache and compresses only the configs after
+// it. Flags are coded from the records as usual, so the output and flags
+// file are the same. Entry: "R2CP", version, output length (~0 for none),
+// flag count, records length (8 bytes each, little endian), then the
+// output and the records.
+static const char CACHE_PREFIX_MAGIC[4] = {'R', '2', 'C', 'P'};
+static const qword NO_OUTPUT = ~0ULL;
+
+struct PrefixEntry {
+  string path;
+  qword out_len = NO_OUTPUT, count = 0, records_len = 0;
+};
+
+// Read the header of a prefix entry, false if there is none or it is
+// damaged
+static bool prefix_entry(PrefixEntry& e) {
+  FILE* f = fopen(e.path.c_str(), "rb");
+  if (!f) return false;
+  fseeko64(f, 0, SEEK_END);
+  qword file_size = ftello64(f);
+  string head;
+  bool ok = read_at(f, 0, 4 + 4 * 8, head) && memcmp(head.data(), CACHE_PREFIX_MAGIC, 4) == 0 &&
+            get_u64(head.data() + 4) == CACHE_VERSION;
+  fclose(f);
+  if (!ok) return false;
+  e.out_len = get_u64(head.data() + 12);
+  e.count = get_u64(head.data() + 20);
+  e.records_len = get_u64(head.data() + 28);
+  qword out = e.out_len == NO_OUTPUT ? 0 : e.out_len;
+  return out <= file_size && e.records_len <= file_size - out && 36 + out + e.records_len == file_size;
+}
+
+// Read the output (if wanted) or the records of a prefix entry
+static bool prefix_read(const PrefixEntry& e, bool output, string& out) {
+  FILE* f = fopen(e.path.c_str(), "rb");
+  if (!f) return false;
+  qword out_len = e.out_len == NO_OUTPUT ? 0 : e.out_len;
+  bool ok = output ? read_at(f, 36, out_len, out) : read_at(f, 36 + out_len, e.records_len, out);
+  fclose(f);
+  return ok;
+}
+
+static void prefix_store(const string& path, const PieceView* output, qword count, const string& records) {
+  string entry(CACHE_PREFIX_MAGIC, 4), text;
+  if (output) view_read(*output, 0, output->length, text);
+  put_u64(entry, CACHE_VERSION);
+  put_u64(entry, output ? text.length() : NO_OUTPUT);
+  put_u64(entry, count);
+  put_u64(entry, records.length());
+  entry += text;
+  entry += records;
+  cache_store(path, entry);
+}
+
+// Prefix entry paths of the configs, for input data
+static vector<string> prefix_paths(const vector<ParsedConfig>& configs, const vector<bool>& escapable,
+                                   string_view data) {
+  qword input = hash64(data.data(), data.length(), CACHE_VERSION);
+  qword h = hash64(BUILD_ID, sizeof(BUILD_ID) - 1, input);
+  vector<string> paths;
+  for (size_t i = 0; i < configs.size(); i++) {
+    string modules(escapable[i] ? "+" : "-");
+    put_u64(modules, flag_models[configs[i].model].digest);
+    if (configs[i].stage_fn) put_u64(modules, configs[i].stage_digest);
+    h = hash64(modules.data(), modules.length(), h ^ config_hash(configs, i, 1));
+    paths.push_back(cache_path('p', input, h));
+  }
+  return paths;
+}
+
+// Take the first configs from the prefix cache: the output after the
+// deepest one with an output entry becomes the store's base, and the
+// records of all of them go to the spill. Returns how many were taken.
+static size_t prefix_resume(const vector<ParsedConfig>& configs, const vector<string>& paths, PieceStore& store,
+                            PieceView& current, FlagSpill& spill, qword& total_flag_count) {
+  vector<PrefixEntry> entries;
+  size_t resume = 0;
+  for (size_t i = 0; i < paths.size(); i++) {
+    PrefixEntry e;
+    e.path = paths[i];
+    if (!prefix_entry(e)) break;
+    entries.push_back(e);
+    if (e.out_len != NO_OUTPUT) resume = i + 1;
+  }
+  string text, records;
+  bool ok = resume == 0 || prefix_read(entries[resume - 1], true, text);
+  qword count = 0;
+  for (size_t i = 0; i < resume && ok; i++) {
+    ok = prefix_read(entries[i], false, records) && spill_records(i, records, entries[i].count, spill);
+    count += entries[i].count;
+  }
+  if (!ok) {
+    // Start over without the cache, the spill file is rewritten
+    fprintf(stderr, "Cache: cannot read %s entries, compressing every config\n", cache_dir);
+    spill.segments.clear();
+    spill.buffer.clear();
+    spill.offset = 0;
+    if (spill.f) fseeko64(spill.f, 0, SEEK_SET);
+    return 0;
+  }
+  if (resume == 0) return 0;
+  store.own(std::move(text));
+  view_flat(store, current);
+  total_flag_count += count;
+  if (!quiet) {
+    for (size_t i = 0; i < resume; i++) {
+      fprintf(stderr, "Config %s: cached, %llu flags\n", configs[i].name.c_str(), entries[i].count);
+    }
+  }
+  fprintf(stderr, "Cache: resuming after config %llu of %llu\n", (qword)resume, (qword)configs.size());
+  return resume;
+}
+
+// Feed the flags of config i from the spill file to the flag model
+static bool replay_flags(size_t i, FlagSpill& spill, qword& written, qword total, int& last_percent) {
+  qword left = spill.segments[i].second;
+  if (left == 0) return true;
+  if (fseeko64(spill.f, spill.segments[i].first, SEEK_SET) != 0) return false;
+  string chunk;
+  size_t pos = 0;
+  FlagRecord rec;
+  // Make n bytes available at pos, the segment may hold fewer
+  auto fill = [&](size_t n) {
+    if (chunk.length() - pos >= n) return;
+    chunk.erase(0, pos);
+    pos = 0;
+    size_t have = chunk.length(), want = max(n, (size_t)1 << 20);
+    chunk.resize(want);
+    chunk.resize(have + fread(&chunk[have], 1, want - have, spill.f));
+  };
+  for (; left > 0; left--) {
+    fill(10);
+    const char* p = chunk.data() + pos;
+    size_t len = get_varint(p);
+    pos = p - chunk.data();
+    fill(len);
+    if (chunk.length() - pos < len) {
+      fprintf(stderr, "Cannot read %s\n", spill.path.c_str());
+      return false;
+    }
+    p = chunk.data() + pos;
+    rec.flag = (byte)*p++;
+    rec.ctx_ofs = (int)get_varint(p);
+    rec.match_len = (int)get_varint(p);
+    rec.ctx_len = (int)get_varint(p);
+    rec.context.assign(p, rec.ctx_len);
+    p += rec.ctx_len;
+    if (API_FEATURES) {
+      FlagFeatures f = {(int)i, (int)get_varint(p) - 1};
+      f.pos = get_varint(p);
+      f.doc = get_varint(p);
+      for (qword& h : f.before) h = get_u64(p), p += 8;
+      for (qword& h : f.after) h = get_u64(p), p += 8;
+      API_FEATURES(&f);
+    }
+    pos += len;
+    API(rec.flag, rec.context.c_str(), rec.ctx_ofs, rec.ctx_len, rec.match_len);
+    written++;
+
+    // Progress reporting
+    int percent = (total > 0) ? (int)(written * 100 / total) : 100;
+    if (percent != last_percent && !quiet) {
+      fprintf(stderr, "\rWriting flags: %d%%", percent);
+      fflush(stderr);
+      last_percent = percent;
+    }
+  }
+  return true;
+}
+
+// Compress the input in store.base into data (the engine's own buffer, or
+// the caller's with the library) - handles list mode
+// Opens and closes the flags file itself (unless per_config_flags)
+static uint compress_store(const vector<ParsedConfig>& configs, PieceStore& store, string& data,
+                           const char* flg_file) {
+  // For list mode, we need to:
+  // 1. Apply transformations in forward order (configs[0], configs[1], ...)
+  // 2. Spill each config's flags as soon as it is done
+  // 3. Write flags to API in reverse config order (for decompression)
+
+  vector<vector<FlagRecord>> all_flags(configs.size());
+  PieceView current;
+  view_flat(store, current);
+
+  vector<bool> escapable = escapable_configs(configs);
+  FlagSpill spill;
+  if (flg_file) spill.path = string(flg_file) + ".spill";
+  // Close and remove the spill file on every return, and in fail()
+  struct SpillCleanup {
+    SpillCleanup(FlagSpill& spill) {
+      running_spill = &spill;
+      fail_cleanup = remove_spill;
+    }
+    ~SpillCleanup() {
+      remove_spill();
+      running_spill = nullptr;
+      fail_cleanup = nullptr;
+    }
+  } cleanup(spill);
+
+  // Take what the prefix cache holds (c with -C)
+  qword total_flag_count = 0;
+  vector<string> paths;
+  size_t resume = 0;
+  if (cache_dir && flg_file && !per_config_flags) {
+    make_dir(cache_dir);
+    paths = prefix_paths(configs, escapable, store.base);
+    resume = prefix_resume(configs, paths, store, current, spill, total_flag_count);
+    spill.keep = true;
+  }
+
+  // Process configs in forward order, fused groups in one pass (from the
+  // first config not taken from the cache)
+  for (auto group : plan_fusion(configs)) {
+    if (group.first + group.second <= resume) continue;
+    if (group.first < resume) {
+      group.second -= resume - group.first;
+      group.first = resume;
+    }
+    if (group.second > 1) {
+      compress_fused(configs, group.first, group.second, store, current, all_flags);
+    } else {
+      size_t i = group.first;
+      qword size_before = current.length;
+      PieceView intermediate;
+      use_model(configs[i].model);
+      verify_record(i, current);
+      compress_single(configs[i], store, current, intermediate, all_flags[i], escapable[i]);
+      current = std::move(intermediate);
+      if (!quiet) fprintf(stderr, "Config %s: %llu -> %llu bytes, %llu flags\n",
+              configs[i].name.c_str(), size_before, (qword)current.length, (qword)all_flags[i].size());
+    }
+    for (size_t i = group.first; i < group.first + group.second; i++) {
+      qword count = all_flags[i].size();
+      total_flag_count += count;
+      if (!spill_flags(configs[i], i, all_flags[i], spill)) return 1;
+      if (!paths.empty()) {
+        prefix_store(paths[i], i + 1 == group.first + group.second ? &current : nullptr, count, spill.kept);
+      }
+    }
+  }
+  if (spill.f && !spill_write(spill)) return 1;
+
+  // The only full copy of the output (none with an output sink)
+  emit_output(current, data);
+  token_index_release(store.base);
+
+  if (per_config_flags) {
+    if (!quiet) fprintf(stderr, "Total flags: %llu\n", total_flag_count);
+    return 0;
+  }
+
+  // Initialize API for encoding (write mode)
+  if (!open_flags(flg_file, 0)) return 1;
+
+  // Write flags in reverse config order (for decompression which processes in reverse)
+  qword flags_written = 0;
+  int last_percent = -1;
+  for (size_t i = configs.size(); i-- > 0;) {
+    use_model(configs[i].model);
+    if (!replay_flags(i, spill, flags_written, total_flag_count, last_percent)) return 1;
+  }
+  if (!quiet) fprintf(stderr, "\r                    \r");  // Clear progress line
+
+  if (!close_flags(flg_file, 0)) return 1;
+
+  if (!quiet) fprintf(stderr, "Total flags: %llu\n", (qword)flags_written);
+
+  return 0;
+}
+
+// Decompress the input in store.base into data, see compress_store
+// open_flags() must be called before this function, close_flags() after
+static void decompress_store(const vector<ParsedConfig>& configs, PieceStore& store, string& data) {
+  qword total_flags = 0;
+  PieceView current;
+  view_flat(store, current);
+
+  // Process configs in reverse order, fused groups in one pass
+  vector<pair<size_t, size_t>> groups = plan_fusion(configs);
+  vector<bool> escapable = escapable_configs(configs);
+  for (size_t k = groups.size(); k-- > 0;) {
+    if (groups[k].second > 1) {
+      total_flags += decompress_fused(configs, groups[k].first, groups[k].second, store, current);
+      continue;
+    }
+    size_t i = groups[k].first;
+    qword len_before = current.length;
+    feature_config = (int)i;
+    if (!open_config_flags(configs[i], i, 1)) fail("Config %s: cannot open its flags", configs[i].name.c_str());
+    qword flag_count = decompress_single(configs[i], store, current, escapable[i]);
+    close_config_flags(i, 1);
+    verify_check(configs, i, current);
+    if (!quiet) fprintf(stderr, "Config %s: %llu -> %llu bytes, %llu flags\n",
+            configs[i].name.c_str(), (qword)len_before, (qword)current.length, flag_count);
+    total_flags += flag_count;
+  }
+
+  // The only full copy of the output (none with an output sink)
+  emit_output(current, data);
+  token_index_release(store.base);
+  if (!quiet) fprintf(stderr, "Total flags: %llu\n", total_flags);
+}
+
+// Compress mode - works on in-memory data, which the engine takes over
+uint mode_compress(const vector<ParsedConfig>& configs, string& data, const char* flg_file) {
+  PieceStore store;
+  store.own(std::move(data));
+  return compress_store(configs, store, data, flg_file);
+}
+
+// Decompress mode - works on in-memory data, see mode_compress
+void mode_decompress(const vector<ParsedConfig>& configs, string& data) {
+  PieceStore store;
+  store.own(std::move(data));
+  decompress_store(configs, store, data);
+}
+
+// Container (mode s, read by mode x): transformed data and flags in one
+// file. The input is cut into blocks at line ends and each block is
+// compressed on its own, the flag models starting over from the warm-start
+// snapshot in every config's segment. Every block is a checkpoint, so
+// restoring a byte range decodes only the blocks that hold it. Block size
+// 0 gives one block.
+//
+// Layout, all fields 8 bytes little endian:
+//   "R2SC", format version (1), config hash, original size, CRC32C of the
+//   original, config count C, block count N, snapshot length, snapshot
+//   (R2SS, empty without -w)
+//   per block: input offset and length, CRC32C of the block input, output
+//   offset and length, then offset and length of the flags of each config
+//   (offsets in the file)
+//   outputs and flag segments of the blocks
+static const char CONTAINER_MAGIC[4] = {'R', '2', 'S', 'C'};
+static const qword CONTAINER_VERSION = 1;
+static const size_t CONTAINER_HEAD = 4 + 7 * 8;
+
+struct ContainerBlock {
+  qword in_ofs, in_len;    // range of the original input
+  qword crc;               // CRC32C of the block input
+  qword out_ofs, out_len;  // transformed data
+  vector<pair<qword, qword>> flags;  // flags segment of each config
+};
+
+// Gear hash table for content-defined block ends
+static const qword* gear_table() {
+  static qword table[256];
+  static bool ready = false;
+  if (!ready) {
+    qword x = 0;
+    for (qword& g : table) {  // splitmix64
+      qword z = (x += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      g = z ^ (z >> 31);
+    }
+    ready = true;
+  }
+  return table;
+}
+
+// End of the block starting at start, chosen by content so that an edit
+// moves only the block ends near it. A gear hash, which depends on the last
+// 64 bytes, marks about one position in block_size / 4, looked for from
+// block_size / 4 bytes in; the block ends after the next line end. Without
+// one in block_size bytes, the block ends after the last line end (or else
+// space) in them, or takes all of them.
+static size_t block_end(const string& data, size_t start, size_t block_size) {
+  if (block_size == 0) return data.length();
+  size_t end = min(data.length(), start + block_size);
+  size_t from = start + block_size / 4;
+  int bits = 0;
+  while (((size_t)2 << bits) <= block_size / 4) bits++;
+  qword mask = bits ? ~0ULL << (64 - bits) : 0;
+  const qword* gear = gear_table();
+  const byte* p = (const byte*)data.data();
+  qword h = 0;
+  for (size_t i = from - min(from - start, (size_t)64); i < end; i++) {
+    h = (h << 1) + gear[p[i]];
+    if (i >= from && (h & mask) == 0) {
+      const void* nl = memchr(p + i, '\n', end - i);
+      if (!nl) break;
+      return (const byte*)nl - p + 1;
+    }
+  }
+  if (end == data.length()) return end;
+  for (char c : {'\n', ' '}) {
+    size_t cut = data.rfind(c, end - 1);
+    if (cut != string::npos && cut >= start) return cut + 1;
+  }
+  return end;
+}
+
+// Block cache (-C dir): the output and flag segments of each container
+// block, in <dir>/b<key><block hash>, where the key hashes the configs,
+// flag models and snapshot. A block seen before is copied from the cache
+// instead of compressed again; blocks are independent, so the container is
+// the same. Entry: "R2CB", version, input length, CRC32C of the input,
+// output length, config count C, C flag segment lengths (8 bytes each,
+// little endian), then the output and the segments.
+static const char CACHE_BLOCK_MAGIC[4] = {'R', '2', 'C', 'B'};
+
+static qword cache_key(const vector<ParsedConfig>& configs) {
+  string modules = BUILD_ID;
+  for (const FlagModel& m : flag_models) put_u64(modules, m.digest);
+  for (const ParsedConfig& cfg : configs) {
+    if (cfg.stage_fn) put_u64(modules, cfg.stage_digest);
+  }
+  qword h = hash64(modules.data(), modules.length(), config_hash(configs) + CACHE_VERSION);
+  return hash64(snapshot_data.data(), snapshot_data.length(), h);
+}
+
+// Load a cached block of b.in_len input bytes with CRC b.crc into part and
+// config_segments, false if there is none or it does not fit
+static bool cache_load_block(const string& path, const ContainerBlock& b, size_t config_count, string& part) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  fseeko64(f, 0, SEEK_END);
+  qword file_size = ftello64(f);
+  string head;
+  qword ofs = 4 + (5 + config_count) * 8;
+  bool ok = read_at(f, 0, ofs, head) && memcmp(head.data(), CACHE_BLOCK_MAGIC, 4) == 0;
+  const char* h = head.data() + 4;
+  ok = ok && get_u64(h) == CACHE_VERSION && get_u64(h + 8) == b.in_len && get_u64(h + 16) == b.crc &&
+       get_u64(h + 32) == config_count;
+  config_segments.assign(config_count, string());
+  for (size_t c = 0; c <= config_count && ok; c++) {
+    qword len = get_u64(h + 24 + (c ? 8 + 8 * c : 0));
+    ok = len <= file_size - min(ofs, file_size) && read_at(f, ofs, len, c ? config_segments[c - 1] : part);
+    ofs += len;
+  }
+  fclose(f);
+  return ok && ofs == file_size;
+}
+
+static void cache_store_block(const string& path, const ContainerBlock& b, const string& part) {
+  string entry(CACHE_BLOCK_MAGIC, 4);
+  put_u64(entry, CACHE_VERSION);
+  put_u64(entry, b.in_len);
+  put_u64(entry, b.crc);
+  put_u64(entry, part.length());
+  put_u64(entry, config_segments.size());
+  for (const string& seg : config_segments) put_u64(entry, seg.length());
+  entry += part;
+  for (const string& seg : config_segments) entry += seg;
+  cache_store(path, entry);
+}
+
+// Compress into a container, flags sessions go through the scratch file
+// <container>.flg
+uint mode_seekable(const vector<ParsedConfig>& configs, const string& data, const char* container,
+                   size_t block_size) {
+  vector<ContainerBlock> blocks;
+  string body;  // outputs and flags of all blocks, offsets relative to its start
+  qword key = cache_dir ? cache_key(configs) : 0, computed = 0, computed_bytes = 0;
+  bool was_quiet = quiet;
+
+  per_config_flags = true;
+  segment_scratch = string(container) + ".flg";
+  if (cache_dir) make_dir(cache_dir);
+  for (size_t start = 0; start < data.length() || blocks.empty();) {
+    size_t end = block_end(data, start, block_size);
+    ContainerBlock b;
+    b.in_ofs = start;
+    b.in_len = end - start;
+    b.crc = crc32c(0, data.data() + start, end - start);
+    string part, entry_path;
+    if (cache_dir) entry_path = cache_path('b', key, hash64(data.data() + start, end - start));
+    if (!cache_dir || !cache_load_block(entry_path, b, configs.size(), part)) {
+      part = data.substr(start, end - start);
+      config_segments.assign(configs.size(), string());
+      quiet = was_quiet || computed > 0;  // report the first block compressed only
+      uint err = mode_compress(configs, part, nullptr);
+      quiet = was_quiet;
+      if (err) {
+        remove(segment_scratch.c_str());
+        return 1;
+      }
+      if (cache_dir) cache_store_block(entry_path, b, part);
+      computed++;
+      computed_bytes += b.in_len;
+    }
+    b.out_ofs = body.length();
+    b.out_len = part.length();
+    body += part;
+    for (const string& seg : config_segments) {
+      b.flags.push_back({body.length(), seg.length()});
+      body += seg;
+    }
+    blocks.push_back(std::move(b));
+    start = end;
+  }
+  per_config_flags = false;
+  remove(segment_scratch.c_str());
+  if (cache_dir) {
+    fprintf(stderr, "Cache: %llu of %llu blocks reused, %llu bytes compressed\n", (qword)blocks.size() - computed,
+            (qword)blocks.size(), computed_bytes);
+  }
+
+  string header(CONTAINER_MAGIC, 4);
+  put_u64(header, CONTAINER_VERSION);
+  put_u64(header, config_hash(configs));
+  put_u64(header, data.length());
+  put_u64(header, crc32c(0, data.data(), data.length()));
+  put_u64(header, configs.size());
+  put_u64(header, blocks.size());
+  put_u64(header, snapshot_data.length());
+  header += snapshot_data;
+  qword base = header.length() + blocks.size() * (5 + 2 * configs.size()) * 8;
+  for (const ContainerBlock& b : blocks) {
+    put_u64(header, b.in_ofs);
+    put_u64(header, b.in_len);
+    put_u64(header, b.crc);
+    put_u64(header, base + b.out_ofs);
+    put_u64(header, b.out_len);
+    for (auto& seg : b.flags) {
+      put_u64(header, base + seg.first);
+      put_u64(header, seg.second);
+    }
+  }
+
+  FILE* f = fopen(container, "wb");
+  bool ok = f && fwrite(header.data(), 1, header.length(), f) == header.length() &&
+            fwrite(body.data(), 1, body.length(), f) == body.length();
+  if (f && fclose(f) != 0) ok = false;
+  if (!ok) {
+    fprintf(stderr, "Cannot write %s\n", container);
+    return 1;
+  }
+  fprintf(stderr, "Container: %llu blocks, %llu -> %llu bytes\n", (qword)blocks.size(), (qword)data.length(),
+          (qword)(header.length() + body.length()));
+  return 0;
+}
+
+// Read the header and index of a container, checking them against the
+// configs before anything is decoded
+static bool read_container(FILE* f, const char* container, const vector<ParsedConfig>& configs,
+                           vector<ContainerBlock>& blocks, qword& size, qword& crc) {
+  fseeko64(f, 0, SEEK_END);
+  qword file_size = ftello64(f);
+  string head, index;
+  if (!read_at(f, 0, CONTAINER_HEAD, head) || memcmp(head.data(), CONTAINER_MAGIC, 4) != 0) {
+    fprintf(stderr, "%s is not a container\n", container);
+    return false;
+  }
+  const char* h = head.data() + 4;
+  qword version = get_u64(h), hash = get_u64(h + 8), config_count = get_u64(h + 32), count = get_u64(h + 40),
+        snap_len = get_u64(h + 48);
+  size = get_u64(h + 16);
+  crc = get_u64(h + 24);
+  if (version != CONTAINER_VERSION) {
+    fprintf(stderr, "%s has container version %llu, this repl2 reads %llu\n", container, version,
+            CONTAINER_VERSION);
+    return false;
+  }
+  if (config_count != configs.size() || hash != config_hash(configs)) {
+    fprintf(stderr, "%s was written with other configs (%llu configs, hash %016llX; given %llu, hash %016llX)\n",
+            container, config_count, hash, (qword)configs.size(), config_hash(configs));
+    return false;
+  }
+  qword entry = (5 + 2 * config_count) * 8;
+  bool ok = snap_len <= file_size && count <= file_size / entry &&
+            read_at(f, CONTAINER_HEAD, snap_len, snapshot_data) &&
+            read_at(f, CONTAINER_HEAD + snap_len, count * entry, index);
+  qword next_in = 0;
+  for (qword k = 0; k < count && ok; k++) {
+    const char* p = index.data() + entry * k;
+    ContainerBlock b;
+    b.in_ofs = get_u64(p);
+    b.in_len = get_u64(p + 8);
+    b.crc = get_u64(p + 16);
+    b.out_ofs = get_u64(p + 24);
+    b.out_len = get_u64(p + 32);
+    ok = b.in_ofs == next_in && b.out_ofs <= file_size && b.out_len <= file_size - b.out_ofs;
+    for (qword c = 0; c < config_count; c++) {
+      qword ofs = get_u64(p + 40 + 16 * c), len = get_u64(p + 48 + 16 * c);
+      ok = ok && ofs <= file_size && len <= file_size - ofs;
+      b.flags.push_back({ofs, len});
+    }
+    next_in = b.in_ofs + b.in_len;
+    blocks.push_back(std::move(b));
+  }
+  if (!ok || next_in != size) {
+    fprintf(stderr, "%s has a damaged index\n", container);
+    return false;
+  }
+  snapshot_in = container;  // for snapshot messages
+  return true;
+}
+
+// Restore bytes [offset, offset + length) of the original from a container,
+// decoding only the blocks that hold them
+uint mode_extract(const vector<ParsedConfig>& configs, const char* container, string& data, qword offset,
+                  qword length) {
+  bool was_quiet = quiet;
+  FILE* f = fopen(container, "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s\n", container);
+    return 1;
+  }
+  vector<ContainerBlock> blocks;
+  qword size, crc;
+  if (!read_container(f, container, configs, blocks, size, crc)) {
+    fclose(f);
+    return 1;
+  }
+
+  qword end = offset + min(length, size - min(offset, size));
+  bool whole = offset == 0 && end == size, intact = true;
+  per_config_flags = true;
+  segment_scratch = string(container) + ".flg";
+  qword decoded = 0;
+  data.clear();
+  for (size_t k = 0; k < blocks.size(); k++) {
+    const ContainerBlock& b = blocks[k];
+    if (b.in_ofs + b.in_len <= offset || b.in_ofs >= end) continue;
+    string part;
+    bool ok = read_at(f, b.out_ofs, b.out_len, part);
+    config_segments.resize(configs.size());
+    for (size_t c = 0; c < configs.size() && ok; c++) {
+      ok = read_at(f, b.flags[c].first, b.flags[c].second, config_segments[c]);
+    }
+    if (!ok) {
+      fprintf(stderr, "Cannot read block %llu of %s\n", (qword)k, container);
+      fclose(f);
+      return 1;
+    }
+    quiet = was_quiet || decoded > 0;
+    mode_decompress(configs, part);
+    quiet = was_quiet;
+    if (part.length() != b.in_len || crc32c(0, part.data(), part.length()) != b.crc) {
+      fprintf(stderr, "Block %llu (bytes %llu..%llu) does not restore to the original\n", (qword)k, b.in_ofs,
+              b.in_ofs + b.in_len);
+      intact = false;
+    }
+    size_t from = (size_t)min((qword)part.length(), max(offset, b.in_ofs) - b.in_ofs);
+    size_t to = (size_t)min((qword)part.length(), min(end, b.in_ofs + b.in_len) - b.in_ofs);
+    data.append(part, from, to - from);
+    decoded++;
+  }
+  per_config_flags = false;
+  remove(segment_scratch.c_str());
+  fclose(f);
+  if (whole && crc32c(0, data.data(), data.length()) != crc) intact = false;
+  fprintf(stderr, "Restored bytes %llu..%llu from %llu of %llu blocks%s\n", offset, offset + data.length(), decoded,
+          (qword)blocks.size(), intact ? "" : " (differs from the original)");
+  return intact ? 0 : 2;
+}
+
+// Verify mode: compress, then decompress the output and flags in the same
+// process and compare with the input, config by config. Only the flags go
+// through a file, which the flag models need: a new temp file per run (see
+// temp_file), removed at the end.
+uint mode_verify(const vector<ParsedConfig>& configs, const string& data) {
+  string flg_file = temp_file("repl2v");
+  if (flg_file.empty()) {
+    fprintf(stderr, "Cannot create a temp file for the flags\n");
+    return 1;
+  }
+  string work = data;
+  verify_enabled = true;
+  verify_sums.assign(configs.size(), StageSums());
+  verify_diverged = false;
+
+  auto start = std::chrono::steady_clock::now();
+  uint err = mode_compress(configs, work, flg_file.c_str());
+  double compress_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  qword flags_size = 0;
+  if (FILE* f = fopen(flg_file.c_str(), "rb")) {
+    fseeko64(f, 0, SEEK_END);
+    flags_size = ftello64(f);
+    fclose(f);
+  }
+  if (!err) {
+    if (!open_flags(flg_file.c_str(), 1)) {
+      err = 1;
+    } else {
+      bool was_quiet = quiet;
+      quiet = true;
+      mode_decompress(configs, work);
+      quiet = was_quiet;
+      close_flags(flg_file.c_str(), 1);
+    }
+  }
+  remove(flg_file.c_str());
+  verify_enabled = false;
+  if (err) return 1;
+  double total_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if (work == data && !verify_diverged) {
+    fprintf(stderr, "Verified: %llu bytes round trip, flags %llu bytes (c %.2fs, d %.2fs)\n", (qword)data.length(),
+            flags_size, compress_time, total_time - compress_time);
+    return 0;
+  }
+  size_t k = 0;
+  while (k < work.length() && k < data.length() && work[k] == data[k]) k++;
+  fprintf(stderr, "Verify failed: restored %llu bytes of %llu, first difference at byte %llu\n",
+          (qword)work.length(), (qword)data.length(), (qword)k);
+  return 1;
+}
+
+// Server mode: the configs are parsed and the flag models loaded once, then
+// jobs come over a Unix domain socket. Workers are forked from the loaded
+// process and all accept on the socket, so up to <workers> jobs run at
+// once, each with its own copy of the flag model state. A worker that
+// dies (e.g. on a damaged flags file) is replaced.
+//
+// A job is one line, fields separated by tabs (or by spaces if there is no
+// tab), paths relative to the server's directory:
+//   c <input> <output> <flags>     compress
+//   d <input> <output> <flags>     decompress
+//   v <input>                      verify the round trip
+// The reply is one line: "ok <input bytes> <output bytes> <milliseconds>"
+// or "error <message>". A connection can send any number of jobs.
+
+// Size of a readable file, -1 if it cannot be opened
+static long long file_size(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return -1;
+  fseeko64(f, 0, SEEK_END);
+  long long size = ftello64(f);
+  fclose(f);
+  return size;
+}
+
+static string run_job(const vector<ParsedConfig>& configs, const string& line) {
+  vector<string> fields;
+  char sep = line.find('\t') != string::npos ? '\t' : ' ';
+  for (size_t pos = 0; pos <= line.length();) {
+    size_t end = line.find(sep, pos);
+    if (end == string::npos) end = line.length();
+    if (end > pos) fields.push_back(line.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  bool transform = fields.size() == 4 && (fields[0] == "c" || fields[0] == "d");
+  if (!transform && !(fields.size() == 2 && fields[0] == "v")) return "error expected c|d <input> <output> <flags> or v <input>";
+  const char* in_file = fields[1].c_str();
+  if (file_size(in_file) < 0) return "error cannot open " + fields[1];
+
+  auto start = std::chrono::steady_clock::now();
+  string data = read_file(in_file);
+  qword in_size = data.length();
+  if (fields[0] == "v") {
+    if (mode_verify(configs, data) != 0) return "error round trip differs";
+  } else if (fields[0] == "c") {
+    if (mode_compress(configs, data, fields[3].c_str()) != 0) return "error cannot write " + fields[3];
+  } else {
+    if (file_size(fields[3].c_str()) < 0) return "error cannot open " + fields[3];
+    if (!open_flags(fields[3].c_str(), 1)) return "error bad flags file " + fields[3];
+    mode_decompress(configs, data);
+    close_flags(fields[3].c_str(), 1);
+  }
+  if (transform && !write_file(fields[2].c_str(), data)) return "error cannot write " + fields[2];
+  qword ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  return "ok " + to_string(in_size) + " " + to_string(transform ? data.length() : in_size) + " " + to_string(ms);
+}
+
+// Run one job line, returns the reply. Errors that end a command line run
+// (fail) end only the job here.
+static string serve_job(const vector<ParsedConfig>& configs, const string& line) {
+  fail_throws = true;
+  string reply;
+  try {
+    reply = run_job(configs, line);
+  } catch (const EngineError& e) {
+    reply = string("error ") + e.what();
+  }
+  if (reply.compare(0, 6, "error ") == 0) abort_run();
+  return reply;
+}
+
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int) {
+  serve_stop = 1;
+}
+
+// Exit status of a worker that cannot accept connections any more: the
+// server does not start another in its place
+static const int WORKER_BROKEN = 2;
+
+// Worker: serve connections until the server stops. An accept() that fails
+// for lack of descriptors or memory is retried after a pause, any other
+// failure ends the worker.
+static void serve_worker(const vector<ParsedConfig>& configs, int listen_fd) {
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  quiet = true;
+  for (;;) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        usleep(100000);
+        continue;
+      }
+      fprintf(stderr, "[%d] Cannot accept connections: %s\n", (int)getpid(), strerror(errno));
+      _exit(WORKER_BROKEN);
+    }
+    string pending;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      pending.append(buf, n);
+      size_t eol;
+      bool ok = true;
+      while (ok && (eol = pending.find('\n')) != string::npos) {
+        string line = pending.substr(0, eol);
+        pending.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        string reply = serve_job(configs, line) + "\n";
+        fprintf(stderr, "[%d] %s: %s", (int)getpid(), line.c_str(), reply.c_str());
+        ok = write(fd, reply.data(), reply.length()) == (ssize_t)reply.length();
+      }
+      if (!ok) break;
+    }
+    close(fd);
+  }
+}
+
+uint mode_serve(const vector<ParsedConfig>& configs, const char* socket_path, int workers) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  struct stat st;
+  if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);  // left by an earlier server
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+    fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+    return 1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_signal;
+  sigaction(SIGTERM, &sa, nullptr);
+  sigaction(SIGINT, &sa, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  vector<pid_t> pids;
+  auto spawn = [&]() {
+    pid_t pid = fork();
+    if (pid == 0) {
+      serve_worker(configs, listen_fd);
+      _exit(0);
+    }
+    if (pid < 0) fprintf(stderr, "Cannot start a worker: %s\n", strerror(errno));
+    return pid;
+  };
+  for (int k = 0; k < workers; k++) {
+    pid_t pid = spawn();
+    if (pid > 0) pids.push_back(pid);
+  }
+  if (pids.empty()) {
+    unlink(socket_path);
+    return 1;
+  }
+  fprintf(stderr, "Serving %llu configs on %s with %llu workers\n", (qword)configs.size(), socket_path,
+          (qword)pids.size());
+
+  while (!serve_stop) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) continue;  // interrupted by a signal
+    auto it = find(pids.begin(), pids.end(), pid);
+    if (it == pids.end() || serve_stop) continue;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_BROKEN) {
+      fprintf(stderr, "Worker %d cannot accept connections, not starting another\n", (int)pid);
+      pids.erase(it);
+      if (pids.empty()) break;
+      continue;
+    }
+    fprintf(stderr, "Worker %d exited, starting another\n", (int)pid);
+    pid_t next = spawn();
+    if (next > 0) *it = next;
+    else pids.erase(it);
+    if (pids.empty()) break;
+  }
+
+  for (pid_t pid : pids) kill(pid, SIGTERM);
+  while (wait(nullptr) > 0) {
+  }
+  close(listen_fd);
+  unlink(socket_path);
+  fprintf(stderr, "Server stopped\n");
+  return 0;
+}
+#else
+uint mode_serve(const vector<ParsedConfig>& configs, const char* socket_path, int workers) {
+  fprintf(stderr, "serve needs Unix domain sockets, not available in this build\n");
+  return 1;
+}
+#endif
+
+// Batch mode: compress many files with the configs parsed and the flag
+// models loaded once. <inputs> is a directory (every regular file in it,
+// by name) or a manifest with one input path per line. File <name> goes to
+// <outdir>/<name> and <outdir>/<name>.flg. Up to <workers> files run at
+// once, each in a process forked from the loaded one, so every file gets
+// its own flag model state and flags file.
+#ifndef _WIN32
+#include <dirent.h>
+#include <poll.h>
+#endif
+
+struct BatchJob {
+  string name;   // for the report
+  string line;   // job line for serve_job()
+  string reply;
+  double seconds = 0;
+};
+
+static bool batch_jobs(const char* inputs, const char* outdir, vector<BatchJob>& jobs) {
+  vector<string> paths;
+  struct stat st;
+  if (stat(inputs, &st) != 0) {
+    fprintf(stderr, "Cannot open %s\n", inputs);
+    return false;
+  }
+  if (S_ISDIR(st.st_mode)) {
+#ifndef _WIN32
+    DIR* dir = opendir(inputs);
+    if (!dir) {
+      fprintf(stderr, "Cannot open %s\n", inputs);
+      return false;
+    }
+    while (dirent* e = readdir(dir)) {
+      string path = string(inputs) + "/" + e->d_name;
+      if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) paths.push_back(path);
+    }
+    closedir(dir);
+    sort(paths.begin(), paths.end());
+#else
+    fprintf(stderr, "Give the inputs of a batch as a manifest on this platform\n");
+    return false;
+#endif
+  } else {
+    string manifest = read_file(inputs);
+    for (size_t pos = 0; pos < manifest.length();) {
+      size_t end = manifest.find('\n', pos);
+      if (end == string::npos) end = manifest.length();
+      string path = manifest.substr(pos, end - pos);
+      if (!path.empty() && path.back() == '\r') path.pop_back();
+      if (!path.empty()) paths.push_back(path);
+      pos = end + 1;
+    }
+  }
+  unordered_map<string, string> taken;  // output name -> input path
+  for (const string& path : paths) {
+    size_t slash = path.find_last_of("/\\");
+    BatchJob job;
+    job.name = slash == string::npos ? path : path.substr(slash + 1);
+    auto it = taken.emplace(job.name, path);
+    if (!it.second) {
+      fprintf(stderr, "Inputs %s and %s would both write %s/%s\n", it.first->second.c_str(), path.c_str(), outdir,
+              job.name.c_str());
+      return false;
+    }
+    string out = string(outdir) + "/" + job.name;
+    job.line = "c\t" + path + "\t" + out + "\t" + out + ".flg";
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint mode_batch(const vector<ParsedConfig>& configs, const char* inputs, const char* outdir, int workers) {
+  vector<BatchJob> jobs;
+  if (!batch_jobs(inputs, outdir, jobs)) return 1;
+  make_dir(outdir);
+  fprintf(stderr, "Batch: %llu files, %d workers\n", (qword)jobs.size(), workers);
+  bool was_quiet = quiet;
+  quiet = true;
+  auto start = std::chrono::steady_clock::now();
+  qword in_total = 0, out_total = 0, flags_total = 0, failed = 0;
+  double busy = 0;
+
+  // Report a finished job
+  auto report = [&](BatchJob& job) {
+    qword in_size = 0, out_size = 0;
+    if (sscanf(job.reply.c_str(), "ok %llu %llu", &in_size, &out_size) != 2) {
+      failed++;
+      fprintf(stderr, "%s: %s\n", job.name.c_str(), job.reply.empty() ? "error worker died" : job.reply.c_str());
+      return;
+    }
+    long long flags = file_size((string(outdir) + "/" + job.name + ".flg").c_str());
+    in_total += in_size;
+    out_total += out_size;
+    flags_total += max(flags, 0LL);
+    busy += job.seconds;
+    fprintf(stderr, "%s: %llu -> %llu + %lld bytes, %.3f s, %.1f MB/s\n", job.name.c_str(), in_size, out_size, flags,
+            job.seconds, in_size / 1e6 / max(job.seconds, 1e-6));
+  };
+
+#ifdef _WIN32
+  // No fork: one file after the other
+  for (BatchJob& job : jobs) {
+    auto job_start = std::chrono::steady_clock::now();
+    job.reply = serve_job(configs, job.line);
+    job.seconds = seconds_since(job_start);
+    report(job);
+  }
+#else
+  // Workers stay up and take one job line at a time over a socket pair,
+  // the next job going to whichever worker replies first
+  struct Worker {
+    pid_t pid = -1;
+    int fd = -1;
+    size_t job = SIZE_MAX;  // job in progress
+    std::chrono::steady_clock::time_point start;
+    string pending;
+  };
+  signal(SIGPIPE, SIG_IGN);
+  auto spawn = [&](Worker& w) {
+    int fds[2];
+    w.fd = -1;  // no worker until the fork succeeds
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+    w.pid = fork();
+    if (w.pid == 0) {
+      close(fds[0]);
+      string line;
+      char c;
+      while (read(fds[1], &c, 1) == 1) {
+        if (c != '\n') {
+          line += c;
+          continue;
+        }
+        string reply = serve_job(configs, line) + "\n";
+        if (write(fds[1], reply.data(), reply.length()) != (ssize_t)reply.length()) break;
+        line.clear();
+      }
+      _exit(0);
+    }
+    close(fds[1]);
+    if (w.pid < 0) {
+      fprintf(stderr, "Cannot start a worker: %s\n", strerror(errno));
+      close(fds[0]);
+      return false;
+    }
+    w.fd = fds[0];
+    w.pending.clear();
+    return true;
+  };
+  vector<Worker> pool(min((size_t)workers, jobs.size()));
+  size_t next = 0, busy_workers = 0;
+  auto assign = [&](Worker& w) {
+    if (next >= jobs.size()) return;
+    string line = jobs[next].line + "\n";
+    w.job = next++;
+    w.start = std::chrono::steady_clock::now();
+    busy_workers++;
+    if (write(w.fd, line.data(), line.length()) != (ssize_t)line.length()) w.pending = "error worker died";
+  };
+  for (Worker& w : pool) {
+    if (spawn(w)) assign(w);
+  }
+  while (busy_workers > 0) {
+    vector<pollfd> fds;
+    for (Worker& w : pool) fds.push_back({w.job != SIZE_MAX ? w.fd : -1, POLLIN, 0});
+    if (poll(fds.data(), fds.size(), -1) < 0) continue;
+    for (size_t k = 0; k < pool.size(); k++) {
+      Worker& w = pool[k];
+      if (w.job == SIZE_MAX || !fds[k].revents) continue;
+      char buf[4096];
+      ssize_t n = read(w.fd, buf, sizeof(buf));
+      if (n > 0) w.pending.append(buf, n);
+      size_t eol = w.pending.find('\n');
+      if (n > 0 && eol == string::npos) continue;
+      BatchJob& job = jobs[w.job];
+      job.seconds = seconds_since(w.start);
+      job.reply = eol == string::npos ? "" : w.pending.substr(0, eol);  // empty: the worker died
+      w.pending.clear();
+      w.job = SIZE_MAX;
+      busy_workers--;
+      report(job);
+      if (eol == string::npos) {
+        close(w.fd);
+        w.fd = -1;
+        waitpid(w.pid, nullptr, 0);
+        if (!spawn(w)) continue;
+      }
+      assign(w);
+    }
+  }
+  for (Worker& w : pool) {
+    if (w.fd >= 0) close(w.fd);
+  }
+  while (wait(nullptr) > 0) {
+  }
+#endif
+  quiet = was_quiet;
+
+  double wall = seconds_since(start);
+  fprintf(stderr, "Total: %llu files (%llu failed), %llu -> %llu + %llu bytes, %.2f s, %.1f MB/s (%.1f MB/s in "
+          "a file)\n", (qword)jobs.size(), failed, in_total, out_total, flags_total, wall,
+          in_total / 1e6 / max(wall, 1e-6), in_total / 1e6 / max(busy, 1e-6));
+  return failed != 0;
+}
+
+// Benchmark mode: time each usable kernel (or the forced one) on every
+// config, collecting all match starts like the backward scan does
+void mode_bench(const vector<ParsedConfig>& configs, const string& data) {
+  const int passes = 3;
+  int forced = kernel_force;
+  printf("%-28s %-9s %6s %7s %8s %9s\n", "config", "kernel", "keys", "bytes", "matches", "ms/pass");
+  for (const ParsedConfig& cfg : configs) {
+    if (cfg.stage_fn) continue;
+
+    kernel_force = forced;
+    KeyMatcher km;
+    build_matcher(cfg, false, km);
+    int chosen = km.kernel;
+    free_matcher(km);
+
+    for (int k = 0; k < KERNEL_COUNT; k++) {
+      if (forced != KERNEL_AUTO && k != forced) continue;
+      kernel_force = k;
+      auto t0 = chrono::steady_clock::now();
+      build_matcher(cfg, false, km);
+      if (km.kernel != k) {
+        free_matcher(km);
+        continue;
+      }
+      qword matches = 0;
+      size_t offset, start, end;
+      for (int r = 0; r < passes; r++) {
+        offset = 0;
+        while (find_match(km, data, offset, start, end)) {
+          matches++;
+          offset = start + 1;
+        }
+        token_index_release(data);
+      }
+      auto t1 = chrono::steady_clock::now();
+      printf("%-28s %-9s %6llu %7llu %8llu %9.2f%s\n", cfg.name.c_str(), kernel_names[k],
+             (qword)km.byte_keys.size(), (qword)km.key_bytes, matches / passes,
+             chrono::duration<double, milli>(t1 - t0).count() / passes, k == chosen ? " *" : "");
+      free_matcher(km);
+    }
+  }
+  kernel_force = forced;
+}
+
+#ifndef REPL2_LIBRARY
+int main(int argc, char **argv) {
+  // Leading options
+  int argi = 1;
+  bool threads_given = false;
+  while (argi + 1 < argc && argv[argi][0] == '-') {
+    if (strcmp(argv[argi], "-k") == 0) {
+      kernel_force = KERNEL_AUTO;
+      for (int k = 0; k < KERNEL_COUNT; k++) {
+        if (strcmp(argv[argi + 1], kernel_names[k]) == 0) kernel_force = k;
+      }
+      if (kernel_force == KERNEL_AUTO && strcmp(argv[argi + 1], "auto") != 0) {
+        fprintf(stderr, "Unknown kernel '%s'\n", argv[argi + 1]);
+        return 1;
+      }
+      argi += 2;
+    } else if (strcmp(argv[argi], "-t") == 0) {
+      scan_threads = atoi(argv[argi + 1]);
+      threads_given = true;
+      if (scan_threads < 1) {
+        fprintf(stderr, "Invalid thread count '%s'\n", argv[argi + 1]);
+        return 1;
+      }
+      argi += 2;
+    } else if (strcmp(argv[argi], "-S") == 0) {
+      fusion_enabled = false;
+      argi++;
+    } else if (strcmp(argv[argi], "-w") == 0) {
+      snapshot_in = argv[argi + 1];
+      argi += 2;
+    } else if (strcmp(argv[argi], "-W") == 0) {
+      snapshot_out = argv[argi + 1];
+      argi += 2;
+    } else if (strcmp(argv[argi], "-C") == 0) {
+      cache_dir = argv[argi + 1];
+      argi += 2;
+    } else {
+      fprintf(stderr, "Unknown option '%s'\n", argv[argi]);
+      return 1;
+    }
+  }
+  argv[argi - 1] = argv[0];
+  argv += argi - 1;
+  argc -= argi - 1;
+
+  bool bench = argc == 4 && strcmp(argv[1], "b") == 0;
+  bool extract = argc >= 2 && strcmp(argv[1], "x") == 0;
+  bool verify = argc >= 2 && strcmp(argv[1], "v") == 0;
+  bool serve = argc >= 2 && strcmp(argv[1], "serve") == 0;
+  bool batch = argc >= 2 && strcmp(argv[1], "batch") == 0;
+  if (!bench && (extract ? argc < 7 || argc > 8
+                 : verify ? argc < 4 || argc > 5
+                 : serve  ? argc < 5 || argc > 6
+                          : argc < 6 || argc > 7)) {
+    fprintf(stderr,
+            "Usage: %s [-k kernel] [-S] [-t threads] [-w snap] [-W snap] [-C dir] <mode> <config> <input> <output> <flags> [dll]\n"
+            "       %s [options] s <config> <input> <container> <block> [dll]\n"
+            "       %s [options] x <config> <container> <output> <offset> <length> [dll]\n"
+            "       %s [options] v <config> <input> [dll]\n"
+            "       %s [options] serve <config> <socket> <workers> [dll]\n"
+            "       %s [options] batch <config> <inputs> <outdir> <workers> [dll]\n"
+            "       %s [-k kernel] b <config> <input>\n"
+            "Options:\n"
+            "  -k kernel - force a match kernel: auto (default), regex, shiftand,\n"
+            "              word, dense, packed (falls back to auto if unusable)\n"
+            "  -S        - scan every config separately (no fused scanning of\n"
+            "              independent configs; output is the same)\n"
+            "  -t threads - threads for match collection (default: all cores;\n"
+            "              output is the same)\n"
+            "  -w snap   - warm-start the flag models from a snapshot (give the\n"
+            "              same snapshot to c and d)\n"
+            "  -W snap   - write the flag model states after the run to snap\n"
+            "  -C dir    - cache directory: with s, blocks seen in an earlier run\n"
+            "              are copied instead of compressed again; with c, a list\n"
+            "              resumes after the longest prefix run before on this input\n"
+            "              (output is the same)\n"
+            "Modes:\n"
             "  c - compress (forward replacement with flag generation)\n"
             "  d - decompress (reverse replacement using flags)\n"
+            "  s - compress into a container of independent blocks of at most <block>\n"
+            "      bytes (cut at line ends chosen by content, 0 = one block); flags go\n"
+            "      inside, one segment per config and block\n"
+            "  x - restore <length> bytes at <offset> of the original from a\n"
+            "      container, decoding only the blocks that hold them (fails at once\n"
+            "      if the configs differ from the ones it was written with)\n"
+            "  v - verify: compress and decompress in memory, compare with the input\n"
+            "      and report the config where the first difference appears\n"
+            "  serve - load configs and DLLs once, then run c, d and v jobs sent as\n"
+            "      lines to a Unix socket, on <workers> processes (0 = one per core)\n"
+            "  batch - compress every file of a directory or manifest <inputs> into\n"
+            "      <outdir>/<name> and <outdir>/<name>.flg, <workers> files at once\n"
+            "  b - benchmark match kernels on input (* = automatic choice)\n"
             "Arguments:\n"
             "  config - config file, or @listfile for a list of configs\n"
+            "           (a list line \"!module [arg]\" adds a transform stage)\n"
+            "           (a line ending in \" >module\" codes that entry's flags with\n"
+            "           its own DLL)\n"
             "  dll - optional: DLL/SO module name (default: default.dll)\n"
             "Examples:\n"
             "  %s c book1.cfg book1 book1.out book1.flg\n"
             "  %s d book1.cfg book1.out book1.rst book1.flg\n"
             "  %s c @list1 book1 book1.out book1.flg\n"
-            "  %s d @list1 book1.out book1.rst book1.flg\n",
-            argv[0], argv[0], argv[0], argv[0], argv[0]);
+            "  %s d @list1 book1.out book1.rst book1.flg\n"
+            "  %s s @list1 book1 book1.r2s 65536\n"
+            "  %s -C cache s @list1 enwik9 enwik9.r2s 1048576\n"
+            "  %s -C cache c @list1 book1 book1.out book1.flg\n"
+            "  %s x @list1 book1.r2s part 100000 5000\n"
+            "  %s v @list1 book1\n"
+            "  %s serve @list1 /tmp/repl2.sock 4\n"
+            "  %s batch @list1 docs docs.out 4\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
     return 1;
   }
 
+  if (bench) {
+    vector<ParsedConfig> configs = argv[2][0] == '@' ? parse_list_file(argv[2] + 1) : load_single_config(argv[2]);
+    string data = read_file(argv[3]);
+    mode_bench(configs, data);
+    unload_dll();
+    return 0;
+  }
+
   // Determine DLL name: argv[6] if provided, otherwise "./default.dll"
   // Note: On Linux, dlopen doesn't search current directory by default
 #ifdef _WIN32
@@ -772,7 +4742,26 @@ int main(int argc, char **argv) {
 #else
   const char* default_dll = "./default.dll";
 #endif
-  const char* dll_name = (argc >= 7) ? argv[6] : default_dll;
+  int dll_arg = extract ? 7 : verify ? 4 : serve ? 5 : 6;
+  const char* dll_name = (argc > dll_arg) ? argv[dll_arg] : default_dll;
+
+  if ((verify || serve || batch) && snapshot_out) {
+    fprintf(stderr, "-W cannot be used with %s\n", argv[1]);
+    return 1;
+  }
+  if ((extract || strcmp(argv[1], "s") == 0) && snapshot_out) {
+    fprintf(stderr, "-W cannot be used with containers (models restart in every block)\n");
+    return 1;
+  }
+  if (cache_dir && strcmp(argv[1], "s") != 0 && strcmp(argv[1], "c") != 0) {
+    fprintf(stderr, "-C can only be used with c and s\n");
+    return 1;
+  }
+  if (extract && snapshot_in) {
+    fprintf(stderr, "-w cannot be used with x (the container holds the snapshot)\n");
+    return 1;
+  }
+  if (snapshot_in) snapshot_data = read_file(snapshot_in);
 
   // Load DLL
   if (!load_dll(dll_name)) {
@@ -782,8 +4771,8 @@ int main(int argc, char **argv) {
   const char* mode = argv[1];
   const char* config_arg = argv[2];
   const char* in_file = argv[3];
-  const char* out_file = argv[4];
-  const char* flg_file = argv[5];
+  const char* out_file = verify ? nullptr : argv[4];
+  const char* flg_file = verify ? nullptr : argv[5];
 
   // Parse config argument - check for @ prefix for list mode
   // Load and parse all configs into memory upfront
@@ -797,6 +4786,10 @@ int main(int argc, char **argv) {
       return 1;
     }
     fprintf(stderr, "List mode: %llu configs\n", (qword)configs.size());
+    if (!load_list_models(configs)) {
+      unload_dll();
+      return 1;
+    }
   } else {
     // Single config mode - load the config(s) from file
     // Note: a single file may contain multiple configs separated by empty lines
@@ -808,27 +4801,98 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (batch) {
+    // in_file is the directory or manifest, out_file the output directory,
+    // flg_file the worker count
+    char* tail;
+    long workers = strtol(flg_file, &tail, 10);
+    if (*tail != 0 || workers < 0) {
+      fprintf(stderr, "Invalid worker count '%s'\n", flg_file);
+      unload_dll();
+      return 1;
+    }
+    if (workers == 0) workers = max(1, (int)std::thread::hardware_concurrency());
+    if (!threads_given) scan_threads = max(1, scan_threads / (int)workers);
+    prebuild_matchers(configs);  // once, shared by the forked workers
+    int result = mode_batch(configs, in_file, out_file, (int)workers);
+    unload_dll();
+    return result;
+  }
+
+  if (serve) {
+    // in_file is the socket, out_file the worker count
+    char* tail;
+    long workers = strtol(out_file, &tail, 10);
+    if (*tail != 0 || workers < 0) {
+      fprintf(stderr, "Invalid worker count '%s'\n", out_file);
+      unload_dll();
+      return 1;
+    }
+    if (workers == 0) workers = max(1, (int)std::thread::hardware_concurrency());
+    prebuild_matchers(configs);  // once, shared by the forked workers
+    int result = mode_serve(configs, in_file, (int)workers);
+    unload_dll();
+    return result;
+  }
+
+  if (extract) {
+    // in_file is the container, flg_file the offset
+    char* tail;
+    qword offset = strtoull(argv[5], &tail, 10), length = 0;
+    if (*tail == 0) length = strtoull(argv[6], &tail, 10);
+    if (*tail != 0 || argv[5][0] == '-' || argv[6][0] == '-') {
+      fprintf(stderr, "Invalid offset or length '%s %s'\n", argv[5], argv[6]);
+      unload_dll();
+      return 1;
+    }
+    string part;
+    uint err = mode_extract(configs, in_file, part, offset, length);
+    // A restore that does not match the original checksums is still written
+    int result = err == 1 || !write_file(out_file, part) ? 1 : err != 0;
+    if (err != 1) fprintf(stderr, "Output: %llu bytes\n", (qword)part.length());
+    unload_dll();
+    return result;
+  }
+
   // Read input file once
   string data = read_file(in_file);
   qword original_size = data.length();
   fprintf(stderr, "Input: %llu bytes\n", (qword)original_size);
 
+  if (verify) {
+    int result = mode_verify(configs, data);
+    unload_dll();
+    return result;
+  }
+
   int result = 0;
   if (strcmp(mode, "c") == 0) {
     if( mode_compress(configs, data, flg_file)!=0 ) {
       unload_dll();
       return 1;
     }
+  } else if (strcmp(mode, "s") == 0) {
+    // out_file is the container, flg_file the block size
+    char* tail;
+    qword block_size = strtoull(flg_file, &tail, 10);
+    if (*tail != 0 || flg_file[0] == '-') {
+      fprintf(stderr, "Invalid block size '%s'\n", flg_file);
+      unload_dll();
+      return 1;
+    }
+    result = mode_seekable(configs, data, out_file, block_size);
+    unload_dll();
+    return result;
   } else if (strcmp(mode, "d") == 0) {
     // Initialize API for decoding (read mode)
-    if (API(-1, flg_file, 1, 0, 0) != 0) {
+    if (!open_flags(flg_file, 1)) {
       unload_dll();
       return 1;
     }
     mode_decompress(configs, data);
-    API(-2, nullptr, 0, 0, 0);  // Close flags file
+    close_flags(flg_file, 1);
   } else {
-    fprintf(stderr, "Invalid mode '%s'. Use 'c' or 'd'.\n", mode);
+    fprintf(stderr, "Invalid mode '%s'. Use 'c', 'd', 's', 'x' or 'v'.\n", mode);
     result = 1;
   }
 
@@ -850,6 +4914,7 @@ int main(int argc, char **argv) {
 
   return result;
 }
+#endif  // REPL2_LIBRARY
 
 
 // DLL loading headers
@@ -859,9 +4924,7 @@ int main(int argc, char **argv) {
 #include <dlfcn.h>
 #endif
 
-// DLL handle
 #ifdef _WIN32
-static HMODULE dll_handle = nullptr;
 char* GetErrorText( void ) {
   wchar_t* lpMsgBuf;
   DWORD dw = GetLastError();
@@ -877,52 +4940,185 @@ char* GetErrorText( void ) {
   for( --wl; wl>=0; wl-- ) if( (byte&)out[wl]<32 ) out[wl]=' ';
   return out;
 }
+#endif
+
+// Transform stage module handles (released by unload_dll)
+#ifdef _WIN32
+static vector<HMODULE> stage_handles;
 #else
-static void* dll_handle = nullptr;
+static vector<void*> stage_handles;
 #endif
 
-// Load DLL and get API function
-static bool load_dll(const char* dll_name) {
+// Hash of the file of the loaded module holding symbol, for cache keys: a
+// module rebuilt or swapped under the same name must not reuse entries. 0
+// if the file cannot be read.
+static qword module_digest(const void* symbol) {
+#ifdef _WIN32
+  HMODULE h;
+  char path[MAX_PATH];
+  if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                          (LPCSTR)symbol, &h) ||
+      !GetModuleFileNameA(h, path, sizeof(path))) {
+    return 0;
+  }
+#else
+  Dl_info info;
+  if (!dladdr(symbol, &info) || !info.dli_fname) return 0;
+  const char* path = info.dli_fname;
+#endif
+  FILE* f = fopen(path, "rb");
+  if (!f) return 0;
+  string data;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+  fclose(f);
+  return hash64(data.data(), data.length(), CACHE_VERSION);
+}
+
+// Load a flag model DLL, returns its index in flag_models or -1. Loading
+// the same module twice gives the same model.
+static int load_model(const char* dll_name) {
+  FlagModel m;
+  m.name = dll_name;
 #ifdef _WIN32
-  dll_handle = LoadLibraryA(dll_name);
-  if (!dll_handle) {
+  HMODULE h = LoadLibraryA(dll_name);
+  if (!h) {
     char* etxt = GetErrorText();
     fprintf(stderr, "Cannot load DLL: %s (error %lu: %s)\n", dll_name, GetLastError(), etxt);
-    return false;
+    return -1;
   }
-  API = (API_func)GetProcAddress(dll_handle, "API");
-  if (!API) {
+  m.handle = (void*)h;
+  m.api = (API_func)GetProcAddress(h, "API");
+  if (!m.api) {
     fprintf(stderr, "Cannot find API function in DLL: %s (error %lu)\n", dll_name, GetLastError());
-    FreeLibrary(dll_handle);
-    dll_handle = nullptr;
-    return false;
+    FreeLibrary(h);
+    return -1;
   }
+  API_CONTEXT_func api_context = (API_CONTEXT_func)GetProcAddress(h, "API_CONTEXT");
+  m.features = (API_FEATURES_func)GetProcAddress(h, "API_FEATURES");
+  m.save = (API_SAVE_func)GetProcAddress(h, "API_SAVE");
+  m.load = (API_LOAD_func)GetProcAddress(h, "API_LOAD");
 #else
-  dll_handle = dlopen(dll_name, RTLD_NOW);
-  if (!dll_handle) {
+  void* h = dlopen(dll_name, RTLD_NOW);
+  if (!h) {
     fprintf(stderr, "Cannot load DLL: %s (%s)\n", dll_name, dlerror());
-    return false;
+    return -1;
   }
-  API = (API_func)dlsym(dll_handle, "API");
-  if (!API) {
+  m.handle = h;
+  m.api = (API_func)dlsym(h, "API");
+  if (!m.api) {
     fprintf(stderr, "Cannot find API function in DLL: %s (%s)\n", dll_name, dlerror());
-    dlclose(dll_handle);
-    dll_handle = nullptr;
-    return false;
+    dlclose(h);
+    return -1;
   }
+  API_CONTEXT_func api_context = (API_CONTEXT_func)dlsym(h, "API_CONTEXT");
+  m.features = (API_FEATURES_func)dlsym(h, "API_FEATURES");
+  m.save = (API_SAVE_func)dlsym(h, "API_SAVE");
+  m.load = (API_LOAD_func)dlsym(h, "API_LOAD");
 #endif
+
+  for (size_t k = 0; k < flag_models.size(); k++) {
+    if (flag_models[k].handle != m.handle) continue;
+#ifdef _WIN32
+    FreeLibrary(h);
+#else
+    dlclose(h);
+#endif
+    return (int)k;
+  }
+  m.digest = module_digest((const void*)m.api);
+  flag_models.push_back(m);
+
+  // Context window requested by the DLL
+  if (api_context) {
+    int before = m.before, after = m.after;
+    if (api_context(&before, &after) != 0 || before < 0 || after < 0 || before > MAX_CONTEXT || after > MAX_CONTEXT) {
+      fprintf(stderr, "Bad context window in DLL: %s (%d before, %d after, at most %d)\n", dll_name, before, after,
+              MAX_CONTEXT);
+      unload_dll();
+      return -1;
+    }
+    flag_models.back().before = before;
+    flag_models.back().after = after;
+  }
+  return (int)flag_models.size() - 1;
+}
+
+// Load the DLL from the command line as model 0
+static bool load_dll(const char* dll_name) {
+  if (load_model(dll_name) != 0) return false;
+  use_model(0);
+  return true;
+}
+
+// Load the flag models named in a list ("config >module")
+static bool load_list_models(vector<ParsedConfig>& configs) {
+  for (ParsedConfig& cfg : configs) {
+    if (cfg.model_name.empty()) continue;
+    cfg.model = load_model(cfg.model_name.c_str());
+    if (cfg.model < 0) return false;
+  }
+  if (flag_models.size() > 255) {
+    fprintf(stderr, "Too many flag models (%llu, at most 255)\n", (qword)flag_models.size());
+    return false;
+  }
+  if (flag_models.size() > 1) fprintf(stderr, "Flag models: %llu\n", (qword)flag_models.size());
   return true;
 }
 
-// Unload DLL
+// Load transform stage module and get STAGE function
+static STAGE_func load_stage(const char* stage_name) {
+  STAGE_func fn;
+#ifdef _WIN32
+  HMODULE h = LoadLibraryA(stage_name);
+  if (!h) {
+    char* etxt = GetErrorText();
+    fprintf(stderr, "Cannot load stage: %s (error %lu: %s)\n", stage_name, GetLastError(), etxt);
+    return nullptr;
+  }
+  fn = (STAGE_func)GetProcAddress(h, "STAGE");
+  if (!fn) {
+    fprintf(stderr, "Cannot find STAGE function in module: %s (error %lu)\n", stage_name, GetLastError());
+    FreeLibrary(h);
+    return nullptr;
+  }
+#else
+  void* h = dlopen(stage_name, RTLD_NOW);
+  if (!h) {
+    fprintf(stderr, "Cannot load stage: %s (%s)\n", stage_name, dlerror());
+    return nullptr;
+  }
+  fn = (STAGE_func)dlsym(h, "STAGE");
+  if (!fn) {
+    fprintf(stderr, "Cannot find STAGE function in module: %s (%s)\n", stage_name, dlerror());
+    dlclose(h);
+    return nullptr;
+  }
+#endif
+  stage_handles.push_back(h);
+  return fn;
+}
+
+// Unload flag models and stage modules
 static void unload_dll() {
-  if (dll_handle) {
+  for (size_t k = 0; k < flag_models.size(); k++) {
 #ifdef _WIN32
-    FreeLibrary(dll_handle);
+    FreeLibrary((HMODULE)flag_models[k].handle);
 #else
-    dlclose(dll_handle);
+    dlclose(flag_models[k].handle);
 #endif
-    dll_handle = nullptr;
   }
+  flag_models.clear();
   API = nullptr;
+  API_FEATURES = nullptr;
+
+  for (size_t i = 0; i < stage_handles.size(); i++) {
+#ifdef _WIN32
+    FreeLibrary(stage_handles[i]);
+#else
+    dlclose(stage_handles[i]);
+#endif
+  }
+  stage_handles.clear();
 }
@@ -112,6 +112,30 @@ string encode_escapes(const string& s) {
   return result;
 }
 
+// Case variants of a template pair: 0=as declared, 1=Capitalized, 2=UPPER
+// Capitalized uppercases the first letter ('cause -> 'Cause)
+string case_variant(const string& s, int cls) {
+  string result(s);
+  bool first = true;
+  for (size_t i = 0; i < result.length(); i++) {
+    if (result[i] >= 'a' && result[i] <= 'z' && (cls == 2 || (cls == 1 && first))) result[i] -= 32;
+    if ((result[i] >= 'a' && result[i] <= 'z') || (result[i] >= 'A' && result[i] <= 'Z')) first = false;
+  }
+  return result;
+}
+
+// Add a pair; a case template (%case) adds its declared, Capitalized and UPPER forms
+void push_pair(vector<ReplacementPair>& pairs, const ReplacementPair& pair, bool fold) {
+  pairs.push_back(pair);
+  if (!fold) return;
+  for (int cls = 1; cls <= 2; cls++) {
+    ReplacementPair v;
+    v.from = case_variant(pair.from, cls);
+    v.to = case_variant(pair.to, cls);
+    pairs.push_back(v);
+  }
+}
+
 string read_file(const char *path) {
   FILE *f;
   qword size;
@@ -158,6 +182,7 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
   // Parse lines
   line_num = 0;
   line_start = 0;
+  bool fold = false;  // %case directive seen
 
   while (line_start < cfg_data.length()) {
     line_end = cfg_data.find('\n', line_start);
@@ -171,6 +196,8 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
       lb = line;
     } else if (line_num == 1) {
       la = line;
+    } else if (line == "%case" || line == "%exact") {
+      fold = (line == "%case");
     } else if (!line.empty() && line.find('\t') != string::npos) {
       size_t tab_pos;
       tab_pos = line.find('\t');
@@ -179,7 +206,7 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
       pair.to = line.substr(tab_pos + 1);
       decode_escapes(pair.from);
       decode_escapes(pair.to);
-      pairs.push_back(pair);
+      push_pair(pairs, pair, fold);
     }
 
     line_start = line_end + 1;
@@ -229,6 +256,10 @@ vector<ParsedConfig> parse_list_file(const char* list_path) {
 
   // Load and parse each config file
   for (const string& path : config_paths) {
+    if (path[0] == '!') {
+      fprintf(stderr, "Skipping transform stage %s (no pairs to check)\n", path.c_str() + 1);
+      continue;
+    }
     ParsedConfig cfg;
     cfg.name = path;
     string cfg_data = read_file(path.c_str());
@@ -260,6 +291,7 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
   // Parse lines
   line_num = 0;
   line_start = 0;
+  bool fold = false;  // %case directive seen
 
   while (line_start < cfg_data.length()) {
     line_end = cfg_data.find('\n', line_start);
@@ -283,7 +315,10 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
           current = ParsedConfig();
           current.name = base_name + "[" + to_string(config_index) + "]";
           line_num = -1;  // Reset for next config (will be incremented to 0)
+          fold = false;
         }
+      } else if (line == "%case" || line == "%exact") {
+        fold = (line == "%case");
       } else if (line.find('\t') != string::npos) {
         size_t tab_pos;
         tab_pos = line.find('\t');
@@ -292,7 +327,7 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
         pair.to = line.substr(tab_pos + 1);
         decode_escapes(pair.from);
         decode_escapes(pair.to);
-        current.pairs.push_back(pair);
+        push_pair(current.pairs, pair, fold);
       }
     }
 
@@ -5,6 +5,7 @@
 
 #define byte byte1
 #include <pcre2.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,7 +15,16 @@
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #undef byte
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 #ifdef _WIN32
 #define off64_t __int64
@@ -85,6 +95,30 @@ void decode_escapes(string &s) {
   s = result;
 }
 
+// Case variants of a template pair: 0=as declared, 1=Capitalized, 2=UPPER
+// Capitalized uppercases the first letter ('cause -> 'Cause)
+string case_variant(const string& s, int cls) {
+  string result(s);
+  bool first = true;
+  for (size_t i = 0; i < result.length(); i++) {
+    if (result[i] >= 'a' && result[i] <= 'z' && (cls == 2 || (cls == 1 && first))) result[i] -= 32;
+    if ((result[i] >= 'a' && result[i] <= 'z') || (result[i] >= 'A' && result[i] <= 'Z')) first = false;
+  }
+  return result;
+}
+
+// Add a pair; a case template (%case) adds its declared, Capitalized and UPPER forms
+void push_pair(vector<ReplacementPair>& pairs, const ReplacementPair& pair, bool fold) {
+  pairs.push_back(pair);
+  if (!fold) return;
+  for (int cls = 1; cls <= 2; cls++) {
+    ReplacementPair v;
+    v.from = case_variant(pair.from, cls);
+    v.to = case_variant(pair.to, cls);
+    pairs.push_back(v);
+  }
+}
+
 string read_file(const char *path) {
   FILE *f;
   qword size;
@@ -131,6 +165,7 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
   // Parse lines
   line_num = 0;
   line_start = 0;
+  bool fold = false;  // %case directive seen
 
   while (line_start < cfg_data.length()) {
     line_end = cfg_data.find('\n', line_start);
@@ -144,6 +179,8 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
       lb = line;
     } else if (line_num == 1) {
       la = line;
+    } else if (line == "%case" || line == "%exact") {
+      fold = (line == "%case");
     } else if (!line.empty() && line.find('\t') != string::npos) {
       size_t tab_pos;
       tab_pos = line.find('\t');
@@ -152,7 +189,7 @@ void parse_config_data(const string& cfg_data_in, string &lb, string &la, vector
       pair.to = line.substr(tab_pos + 1);
       decode_escapes(pair.from);
       decode_escapes(pair.to);
-      pairs.push_back(pair);
+      push_pair(pairs, pair, fold);
     }
 
     line_start = line_end + 1;
@@ -202,6 +239,10 @@ vector<ParsedConfig> parse_list_file(const char* list_path) {
 
   // Load and parse each config file
   for (const string& path : config_paths) {
+    if (path[0] == '!') {
+      fprintf(stderr, "Skipping transform stage %s (not supported by repl2l)\n", path.c_str() + 1);
+      continue;
+    }
     ParsedConfig cfg;
     cfg.name = path;
     string cfg_data = read_file(path.c_str());
@@ -233,6 +274,7 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
   // Parse lines
   line_num = 0;
   line_start = 0;
+  bool fold = false;  // %case directive seen
 
   while (line_start < cfg_data.length()) {
     line_end = cfg_data.find('\n', line_start);
@@ -254,7 +296,10 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
           current = ParsedConfig();
           current.name = base_name + "[" + to_string(config_index) + "]";
           line_num = -1;
+          fold = false;
         }
+      } else if (line == "%case" || line == "%exact") {
+        fold = (line == "%case");
       } else if (line.find('\t') != string::npos) {
         size_t tab_pos;
         tab_pos = line.find('\t');
@@ -263,7 +308,7 @@ vector<ParsedConfig> parse_multi_config_data(const string& cfg_data_in, const st
         pair.to = line.substr(tab_pos + 1);
         decode_escapes(pair.from);
         decode_escapes(pair.to);
-        current.pairs.push_back(pair);
+        push_pair(current.pairs, pair, fold);
       }
     }
 
@@ -322,81 +367,77 @@ string build_alternation(const vector<string_view> &keys) {
   return result;
 }
 
-// Forward replacement: replace all 'from' with 'to'
-void replace_forward(const ParsedConfig& cfg, const string& input, string& output) {
-  const string& lb = cfg.lb;
-  const string& la = cfg.la;
-  const vector<ReplacementPair>& pairs = cfg.pairs;
-  unordered_map<string_view, string_view> forward;
-  vector<string_view> forward_keys;
-  pcre2_code *fwd_re;
-  pcre2_match_data *match_data;
-  int rc;
-  PCRE2_SIZE *ovector;
-  PCRE2_SIZE offset;
-  string fwd_pattern;
-
-  if (pairs.empty()) {
+// A config compiled for one direction: forward replaces 'from' with 'to',
+// backward 'to' with 'from' (the first 'from' of each 'to')
+struct CompiledConfig {
+  const ParsedConfig* cfg;
+  unordered_map<string_view, string_view> map;
+  pcre2_code* re = nullptr;
+};
+
+static void compile_config(const ParsedConfig& cfg, bool backward, CompiledConfig& cc) {
+  vector<string_view> keys;
+
+  if (cfg.pairs.empty()) {
     fprintf(stderr, "No replacement pairs found in config %s\n", cfg.name.c_str());
     exit(1);
   }
-
-  forward_keys.reserve(pairs.size());
-
-  // Build forward map
-  for (size_t i = 0; i < pairs.size(); i++) {
-    string_view from_view(pairs[i].from);
-    string_view to_view(pairs[i].to);
-    forward[from_view] = to_view;
-    forward_keys.push_back(from_view);
+  cc.cfg = &cfg;
+  keys.reserve(cfg.pairs.size());
+  for (size_t i = 0; i < cfg.pairs.size(); i++) {
+    string_view from_view(cfg.pairs[i].from);
+    string_view to_view(cfg.pairs[i].to);
+    string_view key = backward ? to_view : from_view;
+    if (backward && cc.map.find(key) != cc.map.end()) continue;
+    cc.map[key] = backward ? from_view : to_view;
+    keys.push_back(key);
   }
 
-  output.clear();
-  output.reserve(input.length());
-
-  // Build forward regex pattern
-  fwd_pattern = "(?<=" + lb + ")(" + build_alternation(forward_keys) + ")(?=" + la + ")";
-
+  string pattern = "(?<=" + cfg.lb + ")(" + build_alternation(keys) + ")(?=" + cfg.la + ")";
   int errcode;
   PCRE2_SIZE erroffset;
-  fwd_re = pcre2_compile((PCRE2_SPTR)fwd_pattern.c_str(), PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
-  if (!fwd_re) {
+  cc.re = pcre2_compile((PCRE2_SPTR)pattern.c_str(), PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
+  if (!cc.re) {
     fprintf(stderr, "PCRE2 compilation failed\n");
     exit(1);
   }
-  pcre2_jit_compile(fwd_re, PCRE2_JIT_COMPLETE);
-
-  match_data = pcre2_match_data_create_from_pattern(fwd_re, NULL);
+  pcre2_jit_compile(cc.re, PCRE2_JIT_COMPLETE);
+}
 
-  // Forward replacement
-  offset = 0;
-  qword last_end = 0;
+// Replace all matches in input[start, end) and append the result to
+// output. input[0, start) is context for the lookbehind only. Returns the
+// number of replacements.
+static qword replace_all(const CompiledConfig& cc, const string& input, size_t start, string& output) {
+  pcre2_match_data* match_data = pcre2_match_data_create_from_pattern(cc.re, NULL);
+  PCRE2_SIZE offset = start;
+  qword last_end = start;
   qword replace_count = 0;
 
+  output.reserve(output.length() + input.length() - start);
   while (offset < input.length()) {
-    rc = pcre2_jit_match(fwd_re, (PCRE2_SPTR)input.c_str(), input.length(), offset, 0, match_data, NULL);
+    int rc = pcre2_jit_match(cc.re, (PCRE2_SPTR)input.c_str(), input.length(), offset, 0, match_data, NULL);
 
     if (rc < 0)
       break;
 
-    ovector = pcre2_get_ovector_pointer(match_data);
-    PCRE2_SIZE start = ovector[0];
-    PCRE2_SIZE end = ovector[1];
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match_data);
+    PCRE2_SIZE match_start = ovector[0];
+    PCRE2_SIZE match_end = ovector[1];
 
     // Add unmatched portion
-    if (start > last_end) {
-      output.append(input.data() + last_end, start - last_end);
+    if (match_start > last_end) {
+      output.append(input.data() + last_end, match_start - last_end);
     }
 
     // Add replacement
-    string_view match_str(input.data() + start, end - start);
-    string_view repl = forward[match_str];
+    string_view match_str(input.data() + match_start, match_end - match_start);
+    string_view repl = cc.map.find(match_str)->second;
     output.append(repl.data(), repl.length());
 
     replace_count++;
-    last_end = end;
-    offset = end;
-    if (offset == start)
+    last_end = match_end;
+    offset = match_end;
+    if (offset == match_start)
       offset++;
   }
 
@@ -406,149 +447,260 @@ void replace_forward(const ParsedConfig& cfg, const string& input, string& outpu
   }
 
   pcre2_match_data_free(match_data);
-  pcre2_code_free(fwd_re);
-
-  fprintf(stderr, "Config %s: %llu replacements\n", cfg.name.c_str(), replace_count);
+  return replace_count;
 }
 
-// Backward replacement: replace all 'to' with 'from'
-void replace_backward(const ParsedConfig& cfg, const string& input, string& output) {
-  const string& lb = cfg.lb;
-  const string& la = cfg.la;
-  const vector<ReplacementPair>& pairs = cfg.pairs;
-  unordered_map<string_view, string_view> backward;
-  vector<string_view> backward_keys;
-  pcre2_code *bwd_re;
-  pcre2_match_data *match_data;
-  int rc;
-  PCRE2_SIZE *ovector;
-  PCRE2_SIZE offset;
-  string bwd_pattern;
-
-  if (pairs.empty()) {
-    fprintf(stderr, "No replacement pairs found in config %s\n", cfg.name.c_str());
-    exit(1);
-  }
-
-  backward_keys.reserve(pairs.size());
-
-  // Build backward map
-  for (size_t i = 0; i < pairs.size(); i++) {
-    string_view from_view(pairs[i].from);
-    string_view to_view(pairs[i].to);
-    if (backward.find(to_view) == backward.end()) {
-      backward[to_view] = from_view;
-      backward_keys.push_back(to_view);
+// Chunks: the input is cut after a line end, and each chunk goes through
+// all configs on its own, in parallel with the others. That gives the same
+// output as the whole file if no match can reach across a line end and
+// every lookbehind or lookahead sees at most one byte: then the byte before
+// a chunk is '\n' in every intermediate text, and it is given to the
+// lookbehind as context, while the byte after a match is still in its chunk,
+// which ends with a line end. Otherwise the input is one chunk.
+static const size_t CHUNK_SIZE = 1 << 22;
+
+// One item of an lb/la pattern that matches exactly one byte: a literal, an
+// escaped symbol, '.', a class, or an escape like \s or \x41. Advances i.
+static bool single_byte_item(const string& p, size_t& i) {
+  auto escape_ok = [&](size_t k) {  // escape at p[k] == '\\'
+    if (k + 1 >= p.length()) return false;
+    char c = p[k + 1];
+    if (c == 'x') return k + 3 < p.length() && isxdigit((byte)p[k + 2]) && isxdigit((byte)p[k + 3]);
+    return !isalnum((byte)c) || strchr("nrtfaedDsSwWhHvVN", c) != nullptr;
+  };
+  char c = p[i];
+  if (c == '\\') {
+    if (!escape_ok(i)) return false;
+    i += p[i + 1] == 'x' ? 4 : 2;
+  } else if (c == '[') {
+    size_t k = i + 1;
+    if (k < p.length() && p[k] == '^') k++;
+    if (k < p.length() && p[k] == ']') k++;  // literal ']' first
+    while (k < p.length() && p[k] != ']') {
+      if (p[k] == '\\') {
+        if (!escape_ok(k)) return false;
+        k += p[k + 1] == 'x' ? 4 : 2;
+      } else if (p.compare(k, 2, "[:") == 0) {
+        size_t end = p.find(":]", k + 2);
+        if (end == string::npos) return false;
+        k = end + 2;
+      } else {
+        k++;
+      }
     }
+    if (k >= p.length()) return false;
+    i = k + 1;
+  } else if (strchr("^$|()*+?{}", c)) {
+    return false;
+  } else {
+    i++;
   }
+  return i >= p.length() || !strchr("*+?{", p[i]);  // no quantifier
+}
 
-  output.clear();
-  output.reserve(input.length() * 2);
-
-  // Build backward regex pattern
-  bwd_pattern = "(?<=" + lb + ")(" + build_alternation(backward_keys) + ")(?=" + la + ")";
-
-  int errcode;
-  PCRE2_SIZE erroffset;
-  bwd_re = pcre2_compile((PCRE2_SPTR)bwd_pattern.c_str(), PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
-  if (!bwd_re) {
-    fprintf(stderr, "PCRE2 compilation failed\n");
-    exit(1);
+// Whether an lb/la pattern sees at most one byte: alternatives of at most
+// one single-byte item each, optionally in one group. Anything else, e.g.
+// a lookaround like (?=\nT), \b or an anchor, may look past the chunk ends.
+static bool single_byte_lookaround(string p) {
+  if (p.length() >= 2 && p.back() == ')' && (p.compare(0, 3, "(?:") == 0 || (p[0] == '(' && p[1] != '?'))) {
+    p = p.substr(p[1] == '?' ? 3 : 1, p.length() - (p[1] == '?' ? 4 : 2));
   }
-  pcre2_jit_compile(bwd_re, PCRE2_JIT_COMPLETE);
-
-  match_data = pcre2_match_data_create_from_pattern(bwd_re, NULL);
-
-  // Backward replacement
-  offset = 0;
-  qword last_end = 0;
-  qword replace_count = 0;
-
-  while (offset < input.length()) {
-    rc = pcre2_jit_match(bwd_re, (PCRE2_SPTR)input.c_str(), input.length(), offset, 0, match_data, NULL);
-
-    if (rc < 0)
-      break;
-
-    ovector = pcre2_get_ovector_pointer(match_data);
-    PCRE2_SIZE start = ovector[0];
-    PCRE2_SIZE end = ovector[1];
-
-    // Add unmatched portion
-    if (start > last_end) {
-      output.append(input.data() + last_end, start - last_end);
+  size_t items = 0;
+  for (size_t i = 0; i < p.length();) {
+    if (p[i] == '|') {
+      items = 0;
+      i++;
+      continue;
     }
-
-    // Add replacement
-    string_view match_str(input.data() + start, end - start);
-    string_view repl = backward[match_str];
-    output.append(repl.data(), repl.length());
-
-    replace_count++;
-    last_end = end;
-    offset = end;
-    if (offset == start)
-      offset++;
+    if (++items > 1 || !single_byte_item(p, i)) return false;
   }
+  return true;
+}
 
-  // Add remaining portion
-  if (last_end < input.length()) {
-    output.append(input.data() + last_end, input.length() - last_end);
+static bool chunks_safe(const vector<ParsedConfig>& configs) {
+  for (const ParsedConfig& cfg : configs) {
+    if (!single_byte_lookaround(cfg.lb) || !single_byte_lookaround(cfg.la)) {
+      fprintf(stderr, "Config %s: lb/la look past one byte, processing the input as one chunk\n",
+              cfg.name.c_str());
+      return false;
+    }
+    for (const ReplacementPair& pair : cfg.pairs) {
+      if (pair.from.find('\n') != string::npos || pair.to.find('\n') != string::npos) {
+        fprintf(stderr, "Config %s: pairs hold line ends, processing the input as one chunk\n", cfg.name.c_str());
+        return false;
+      }
+    }
   }
-
-  pcre2_match_data_free(match_data);
-  pcre2_code_free(bwd_re);
-
-  fprintf(stderr, "Config %s: %llu replacements\n", cfg.name.c_str(), replace_count);
+  return true;
 }
 
-// Compress mode: apply forward replacements in order
-void mode_compress(const vector<ParsedConfig>& configs, string& data) {
-  string current = data;
-  string output;
+struct Chunk {
+  string data;          // input, then output
+  bool first = false;   // starts the input (no line end before it)
+  bool done = false;
+  vector<qword> counts;  // replacements per config
+  vector<qword> sizes;   // output size per config
+};
 
-  for (size_t i = 0; i < configs.size(); i++) {
-    qword size_before = current.length();
-    replace_forward(configs[i], current, output);
-    fprintf(stderr, "Config %s: %llu -> %llu bytes\n",
-            configs[i].name.c_str(), size_before, (qword)output.length());
-    current = std::move(output);
+// Run a chunk through the configs, in order
+static void transform_chunk(const vector<CompiledConfig>& pipeline, Chunk& chunk) {
+  string subject, output;
+  chunk.counts.assign(pipeline.size(), 0);
+  chunk.sizes.assign(pipeline.size(), 0);
+  for (size_t i = 0; i < pipeline.size(); i++) {
+    size_t start = chunk.first ? 0 : 1;
+    subject.assign(start, '\n');
+    subject += chunk.data;
+    output.clear();
+    chunk.counts[i] = replace_all(pipeline[i], subject, start, output);
+    chunk.data.swap(output);
+    chunk.sizes[i] = chunk.data.length();
   }
-
-  data = std::move(current);
 }
 
-// Decompress mode: apply backward replacements in reverse order
-void mode_decompress(const vector<ParsedConfig>& configs, string& data) {
-  string current = data;
-  string output;
+// Read up to size more bytes into buf, false at the end of the input
+static bool read_more(FILE* in, string& buf, size_t size) {
+  size_t have = buf.length();
+  buf.resize(have + size);
+  size_t got = fread(&buf[have], 1, size, in);
+  buf.resize(have + got);
+  return got > 0;
+}
 
-  for (int i = (int)configs.size() - 1; i >= 0; i--) {
-    qword size_before = current.length();
-    replace_backward(configs[i], current, output);
-    fprintf(stderr, "Config %s: %llu -> %llu bytes\n",
-            configs[i].name.c_str(), size_before, (qword)output.length());
-    current = std::move(output);
+// Stream in through the configs (forward, or backward in reverse order)
+// to out: one reader/writer thread and `threads` transform threads, with
+// at most 2 * threads chunks in memory
+static bool run_stream(const vector<ParsedConfig>& configs, bool backward, FILE* in, FILE* out, int threads,
+                       qword& in_size, qword& out_size) {
+  vector<CompiledConfig> pipeline(configs.size());
+  for (size_t k = 0; k < configs.size(); k++) {
+    size_t i = backward ? configs.size() - 1 - k : k;
+    compile_config(configs[i], backward, pipeline[k]);
   }
-
-  data = std::move(current);
+  bool chunked = chunks_safe(configs);
+
+  std::mutex lock;
+  std::condition_variable changed;
+  deque<shared_ptr<Chunk>> queue;   // in input order, waiting for a thread
+  deque<shared_ptr<Chunk>> pending; // in input order, all not yet written
+  bool finished = false;
+
+  auto work = [&]() {
+    for (;;) {
+      shared_ptr<Chunk> chunk;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&] { return !queue.empty() || finished; });
+        if (queue.empty()) return;
+        chunk = queue.front();
+        queue.pop_front();
+      }
+      transform_chunk(pipeline, *chunk);
+      std::lock_guard<std::mutex> guard(lock);
+      chunk->done = true;
+      changed.notify_all();
+    }
+  };
+  vector<std::thread> pool;
+  for (int t = 0; t < threads; t++) pool.emplace_back(work);
+
+  vector<qword> counts(pipeline.size(), 0), sizes(pipeline.size(), 0);
+  bool ok = true;
+  // Write finished chunks from the front, waiting until fewer than limit
+  // are pending
+  auto drain = [&](size_t limit) {
+    for (;;) {
+      shared_ptr<Chunk> chunk;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&] { return pending.size() < limit || pending.front()->done; });
+        if (pending.size() < limit && (pending.empty() || !pending.front()->done)) return;
+        chunk = pending.front();
+        pending.pop_front();
+      }
+      for (size_t i = 0; i < pipeline.size(); i++) {
+        counts[i] += chunk->counts[i];
+        sizes[i] += chunk->sizes[i];
+      }
+      out_size += chunk->data.length();
+      if (fwrite(chunk->data.data(), 1, chunk->data.length(), out) != chunk->data.length()) ok = false;
+    }
+  };
+
+  string buf;
+  bool more = true, first = true;
+  in_size = out_size = 0;
+  while (more || !buf.empty()) {
+    // Cut after the last line end, reading on until there is one
+    size_t cut = string::npos;
+    while (more && (!chunked || buf.length() < CHUNK_SIZE || (cut = buf.rfind('\n')) == string::npos)) {
+      more = read_more(in, buf, CHUNK_SIZE);
+    }
+    if (!more || cut == string::npos) cut = buf.length();
+    else cut++;
+    auto chunk = make_shared<Chunk>();
+    chunk->data = buf.substr(0, cut);
+    chunk->first = first;
+    buf.erase(0, cut);
+    in_size += chunk->data.length();
+    first = false;
+    drain(2 * threads);
+    std::lock_guard<std::mutex> guard(lock);
+    queue.push_back(chunk);
+    pending.push_back(chunk);
+    changed.notify_all();
+  }
+  drain(1);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    finished = true;
+    changed.notify_all();
+  }
+  for (std::thread& th : pool) th.join();
+  for (CompiledConfig& cc : pipeline) pcre2_code_free(cc.re);
+
+  qword size = in_size;
+  for (size_t k = 0; k < pipeline.size(); k++) {
+    fprintf(stderr, "Config %s: %llu replacements\n", pipeline[k].cfg->name.c_str(), counts[k]);
+    fprintf(stderr, "Config %s: %llu -> %llu bytes\n", pipeline[k].cfg->name.c_str(), size, sizes[k]);
+    size = sizes[k];
+  }
+  return ok;
 }
 
 int main(int argc, char **argv) {
+  // Leading options
+  int threads = max(1, (int)std::thread::hardware_concurrency());
+  int argi = 1;
+  while (argi + 1 < argc && strcmp(argv[argi], "-t") == 0) {
+    threads = atoi(argv[argi + 1]);
+    if (threads < 1) {
+      fprintf(stderr, "Invalid thread count '%s'\n", argv[argi + 1]);
+      return 1;
+    }
+    argi += 2;
+  }
+  argv[argi - 1] = argv[0];
+  argv += argi - 1;
+  argc -= argi - 1;
+
   if (argc != 5) {
     fprintf(stderr,
-            "Usage: %s <mode> <config> <input> <output>\n"
+            "Usage: %s [-t threads] <mode> <config> <input> <output>\n"
             "Modes:\n"
             "  c - compress (forward replacement: from -> to)\n"
             "  d - decompress (backward replacement: to -> from)\n"
             "Arguments:\n"
             "  config - config file, or @listfile for a list of configs\n"
+            "  input, output - files, or - for stdin/stdout (streamed in chunks)\n"
+            "  -t threads - chunks transformed at once (default: all cores)\n"
             "Examples:\n"
             "  %s c book1.cfg book1 book1.out\n"
             "  %s d book1.cfg book1.out book1.rst\n"
             "  %s c @list1 book1 book1.out\n"
-            "  %s d @list1 book1.out book1.rst\n",
-            argv[0], argv[0], argv[0], argv[0], argv[0]);
+            "  %s d @list1 book1.out book1.rst\n"
+            "  %s c @list1 - - < enwik9 | fp8 ...\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
     return 1;
   }
 
@@ -557,6 +709,11 @@ int main(int argc, char **argv) {
   const char* in_file = argv[3];
   const char* out_file = argv[4];
 
+  if (strcmp(mode, "c") != 0 && strcmp(mode, "d") != 0) {
+    fprintf(stderr, "Invalid mode '%s'. Use 'c' or 'd'.\n", mode);
+    return 1;
+  }
+
   // Parse config argument - check for @ prefix for list mode
   vector<ParsedConfig> configs;
   if (config_arg[0] == '@') {
@@ -574,32 +731,31 @@ int main(int argc, char **argv) {
     }
   }
 
-  // Read input file
-  string data = read_file(in_file);
-  qword original_size = data.length();
-  fprintf(stderr, "Input: %llu bytes\n", original_size);
-
-  int result = 0;
-  if (strcmp(mode, "c") == 0) {
-    mode_compress(configs, data);
-  } else if (strcmp(mode, "d") == 0) {
-    mode_decompress(configs, data);
-  } else {
-    fprintf(stderr, "Invalid mode '%s'. Use 'c' or 'd'.\n", mode);
-    result = 1;
+  // Open input and output ("-" for stdin/stdout)
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  FILE* in = strcmp(in_file, "-") == 0 ? stdin : fopen(in_file, "rb");
+  if (!in) {
+    fprintf(stderr, "Cannot open %s\n", in_file);
+    return 1;
   }
-
-  if (result == 0) {
-    FILE *out = fopen(out_file, "wb");
-    if (!out) {
-      fprintf(stderr, "Cannot open %s for writing\n", out_file);
-      result = 1;
-    } else {
-      fwrite(data.c_str(), 1, data.length(), out);
-      fclose(out);
-      fprintf(stderr, "Output: %llu bytes\n", (qword)data.length());
-    }
+  FILE* out = strcmp(out_file, "-") == 0 ? stdout : fopen(out_file, "wb");
+  if (!out) {
+    fprintf(stderr, "Cannot open %s for writing\n", out_file);
+    return 1;
   }
 
-  return result;
+  qword in_size, out_size;
+  bool ok = run_stream(configs, strcmp(mode, "d") == 0, in, out, threads, in_size, out_size);
+  if (in != stdin) fclose(in);
+  if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) ok = false;
+  if (!ok) {
+    fprintf(stderr, "Cannot write %s\n", out_file);
+    return 1;
+  }
+  fprintf(stderr, "Input: %llu bytes\n", in_size);
+  fprintf(stderr, "Output: %llu bytes\n", out_size);
+  return 0;
 }
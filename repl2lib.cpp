@@ -0,0 +1,135 @@
+// Library build of repl2: the engine of repl2.cpp without its main, behind
+// the interface of repl2lib.h. Only Repl2ConfigSet is exported; the build
+// hides the engine's own symbols (see the Makefile).
+
+#define REPL2_LIBRARY
+#include "repl2.cpp"
+#include "repl2lib.h"
+
+#include <mutex>
+
+// A loaded set owns its configs (with their matchers, built at load),
+// flag models, stage modules and snapshot. The engine works on globals, so
+// a call swaps them in and out again, holding engine_lock meanwhile.
+static std::mutex engine_lock;
+
+struct Repl2ConfigSet::State {
+  vector<ParsedConfig> configs;
+  vector<FlagModel> models;
+  decltype(stage_handles) stages;
+  string snapshot;
+
+  void swap() {
+    flag_models.swap(models);
+    stage_handles.swap(stages);
+    snapshot_data.swap(snapshot);
+  }
+};
+
+Repl2ConfigSet* Repl2ConfigSet::load(const char* config, const char* dll, const char* snapshot) {
+#ifdef _WIN32
+  const char* default_dll = "default.dll";
+#else
+  const char* default_dll = "./default.dll";
+#endif
+  std::unique_lock<std::mutex> lock(engine_lock);
+  fail_throws = true;  // engine errors come back as EngineError
+  Repl2ConfigSet* set = new Repl2ConfigSet;
+  set->state = new State;
+  State& st = *set->state;
+  st.swap();
+  bool ok = false;
+  try {
+    if (snapshot) snapshot_data = read_file(snapshot);
+    ok = load_dll(dll ? dll : default_dll);
+    if (ok) {
+      bool list = config[0] == '@';
+      st.configs = list ? parse_list_file(config + 1) : load_single_config(config);
+      if (st.configs.empty()) fprintf(stderr, "No configs found in %s\n", config);
+      ok = !st.configs.empty() && (!list || load_list_models(st.configs));
+    }
+    if (ok) prebuild_matchers(st.configs);
+  } catch (const EngineError& e) {
+    fprintf(stderr, "%s\n", e.what());
+    ok = false;
+  }
+  st.swap();
+  lock.unlock();
+  if (!ok) {
+    delete set;
+    return nullptr;
+  }
+  return set;
+}
+
+Repl2ConfigSet::~Repl2ConfigSet() {
+  std::lock_guard<std::mutex> lock(engine_lock);
+  state->swap();
+  unload_dll();
+  state->swap();
+  delete state;
+}
+
+size_t Repl2ConfigSet::config_count() const {
+  return state->configs.size();
+}
+
+int Repl2ConfigSet::run(bool encode, const char* data, size_t len, Repl2Sink sink, void* user, const char* flg_file) {
+  std::lock_guard<std::mutex> lock(engine_lock);
+  State& st = *state;
+  st.swap();
+  use_model(0);
+  bool was_quiet = quiet;
+  quiet = !verbose;
+  output_sink = sink;
+  output_sink_user = user;
+
+  // The engine reads the caller's buffer in place; the output goes to the
+  // sink, so out stays empty
+  PieceStore store;
+  store.base = string_view(data, len);
+  string out;
+  int err = 0;
+  try {
+    if (encode) {
+      err = compress_store(st.configs, store, out, flg_file) != 0;
+    } else if (!open_flags(flg_file, 1)) {
+      err = 1;
+    } else {
+      decompress_store(st.configs, store, out);
+      err = !close_flags(flg_file, 1);
+    }
+  } catch (const EngineError& e) {
+    fprintf(stderr, "%s\n", e.what());
+    err = 1;
+  }
+  if (err) abort_run();
+
+  output_sink = nullptr;
+  output_sink_user = nullptr;
+  quiet = was_quiet;
+  st.swap();
+  return err;
+}
+
+int Repl2ConfigSet::compress(const char* data, size_t len, Repl2Sink sink, void* user, const char* flg_file) {
+  return run(true, data, len, sink, user, flg_file);
+}
+
+int Repl2ConfigSet::decompress(const char* data, size_t len, Repl2Sink sink, void* user, const char* flg_file) {
+  return run(false, data, len, sink, user, flg_file);
+}
+
+static void append_sink(void* user, const char* data, size_t len) {
+  ((string*)user)->append(data, len);
+}
+
+int Repl2ConfigSet::compress(const std::string& in, std::string& out, const char* flg_file) {
+  out.clear();
+  return run(true, in.data(), in.length(), append_sink, &out, flg_file);
+}
+
+int Repl2ConfigSet::decompress(const std::string& in, std::string& out, const char* flg_file) {
+  out.clear();
+  return run(false, in.data(), in.length(), append_sink, &out, flg_file);
+}
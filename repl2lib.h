@@ -0,0 +1,71 @@
+// Library interface of repl2 (librepl2.a, librepl2.so, see "make lib")
+//
+// A Repl2ConfigSet is loaded once: configs parsed, stage modules and flag
+// models loaded. It then compresses or decompresses any number of buffers,
+// with the same output and flags files as "repl2 c" and "repl2 d".
+//
+//   Repl2ConfigSet* set = Repl2ConfigSet::load("@list1", "./default.dll");
+//   set->compress(data, len, sink, user, "doc.flg");
+//
+// The output goes to the caller's sink, in order, as it is produced: the
+// final pieces are pushed straight from the engine's buffers, so a consumer
+// such as a compressor never needs the whole output in one buffer or file.
+// Flags still go to a file, because flag models write files.
+//
+// The input is read in place, not copied. Calls run one at a time per
+// process (flag models keep their state in globals): calls from several
+// threads, on one set or several, wait for each other. The engine reports
+// errors on stderr. Errors that end the tool (a config file that cannot be
+// read, a pattern that does not compile, a damaged input) make load return
+// null and the other calls return nonzero; the set stays usable.
+//
+// Link: g++ app.cpp librepl2.a -lpcre2-8 -ldl -pthread
+
+#ifndef REPL2LIB_H
+#define REPL2LIB_H
+
+#include <stddef.h>
+#include <string>
+
+#ifdef _WIN32
+#define REPL2_EXPORT __declspec(dllexport)
+#else
+#define REPL2_EXPORT __attribute__((visibility("default")))
+#endif
+
+// Receives len bytes of output; data is valid until it returns
+typedef void (*Repl2Sink)(void* user, const char* data, size_t len);
+
+class REPL2_EXPORT Repl2ConfigSet {
+ public:
+  // config: a config file or "@listfile", as on the command line. dll: the
+  // flag model (./default.dll if null). snapshot: warm-start snapshot, as
+  // with -w, or null. Returns null on failure.
+  static Repl2ConfigSet* load(const char* config, const char* dll = nullptr, const char* snapshot = nullptr);
+  ~Repl2ConfigSet();
+
+  // Transform len bytes at data into the sink. Compress writes flg_file,
+  // decompress reads it. Return 0 on success.
+  int compress(const char* data, size_t len, Repl2Sink sink, void* user, const char* flg_file);
+  int decompress(const char* data, size_t len, Repl2Sink sink, void* user, const char* flg_file);
+
+  // The same into a string
+  int compress(const std::string& in, std::string& out, const char* flg_file);
+  int decompress(const std::string& in, std::string& out, const char* flg_file);
+
+  // Per-config reports on stderr (off by default)
+  void set_verbose(bool on) { verbose = on; }
+
+  size_t config_count() const;
+
+ private:
+  struct State;
+  State* state;
+  bool verbose = false;
+  Repl2ConfigSet() = default;
+  Repl2ConfigSet(const Repl2ConfigSet&) = delete;
+  Repl2ConfigSet& operator=(const Repl2ConfigSet&) = delete;
+  int run(bool encode, const char* data, size_t len, Repl2Sink sink, void* user, const char* flg_file);
+};
+
+#endif
@@ -0,0 +1,61 @@
+// Transform stage ABI for repl2 list files
+//
+// A list file line of the form "!module [arg]" refers to a native transform
+// stage instead of a regex config. The module exports one function:
+//
+//   extern "C" int STAGE(int op, StageIO* io);
+//
+// op=STAGE_INIT:     io->arg holds the argument string from the list line,
+//                    returns 0 on success
+// op=STAGE_FORWARD:  transform io->in (forward), write output via io->out(),
+//                    emit one flag per restoration point via io->flag()
+// op=STAGE_BACKWARD: restore io->in (backward), write output via io->out(),
+//                    read flags via io->getflag() in the same order
+// op=STAGE_DONE:     release per-run state, returns 0
+//
+// A run is one INIT, the FORWARD or BACKWARD calls, and one DONE, all with
+// the same io. Per-run state belongs in io->state (null at INIT), not in
+// globals: a process may run a stage many times, e.g. through the library.
+//
+// FORWARD and BACKWARD are called once per chunk. io->in points to the
+// unconsumed tail of the previous call followed by the new chunk; io->final
+// is 1 for the last chunk. The stage returns the number of input bytes it
+// has consumed (the host keeps the rest for the next call), or -1 on error.
+// On the final chunk the stage must consume everything.
+//
+// The host handles ordering: forward flags are cached and written in reverse
+// config order together with flags of regex configs, and getflag() reads
+// from the same flags stream. Contexts passed to flag()/getflag() must be
+// built from the transformed side so that both directions see equal data.
+
+#ifndef STAGE_API_H
+#define STAGE_API_H
+
+#include <stddef.h>
+
+enum {
+  STAGE_INIT = 0,
+  STAGE_FORWARD = 1,
+  STAGE_BACKWARD = 2,
+  STAGE_DONE = 3
+};
+
+struct StageIO {
+  const char* in;    // input chunk
+  size_t in_len;     // input chunk length
+  int final;         // 1 if this is the last chunk
+  const char* arg;   // argument from the list line (STAGE_INIT)
+  void* host;        // host handle, pass back to callbacks
+  void* state;       // the stage's per-run state, set at STAGE_INIT
+
+  // write transformed bytes
+  void (*out)(void* host, const char* data, size_t len);
+  // forward: emit a flag (0/1) with context, same layout as API()
+  void (*flag)(void* host, int bit, const char* ctx, int ofs, int len, int mlen);
+  // backward: read a flag, returns 0/1 or -1 on EOF
+  int (*getflag)(void* host, const char* ctx, int ofs, int len, int mlen);
+};
+
+typedef int (*STAGE_func)(int op, StageIO* io);
+
+#endif
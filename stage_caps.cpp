@@ -0,0 +1,86 @@
+// Example transform stage for repl2 list files (see stage_api.h)
+// Lowercases the first letter of each sentence, one flag per sentence start
+// Compile on Linux: g++ -shared -fPIC -o stage_caps.dll stage_caps.cpp
+// Compile on Windows: cl /LD stage_caps.cpp /Fe:stage_caps.dll
+// List file usage: !./stage_caps.dll
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stage_api.h"
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT __attribute__((visibility("default")))
+#endif
+
+// Left context passed with each flag (transformed side)
+static const int CTX_BEFORE = 32;
+
+// Per-run state (io->state)
+struct CapsState {
+  char hist[CTX_BEFORE + 1];  // last transformed bytes + current symbol
+  int hist_len;
+  unsigned char prev1, prev2;  // last two input bytes
+};
+
+static int is_upper(unsigned char c) { return c >= 'A' && c <= 'Z'; }
+static int is_lower(unsigned char c) { return c >= 'a' && c <= 'z'; }
+
+// Sentence start: "<.!?> <letter>"
+static int at_sentence_start(const CapsState* s) {
+  return s->prev1 == ' ' && (s->prev2 == '.' || s->prev2 == '!' || s->prev2 == '?');
+}
+
+static void hist_push(CapsState* s, char c) {
+  if (s->hist_len == CTX_BEFORE) {
+    memmove(s->hist, s->hist + 1, CTX_BEFORE - 1);
+    s->hist_len--;
+  }
+  s->hist[s->hist_len++] = c;
+}
+
+extern "C" DLLEXPORT int STAGE(int op, StageIO* io) {
+  if (op == STAGE_INIT) {
+    io->state = calloc(1, sizeof(CapsState));
+    return io->state ? 0 : 1;
+  }
+  if (op == STAGE_DONE) {
+    free(io->state);
+    io->state = nullptr;
+    return 0;
+  }
+
+  CapsState* s = (CapsState*)io->state;
+  char* hist = s->hist;
+
+  for (size_t i = 0; i < io->in_len; i++) {
+    unsigned char c = (unsigned char)io->in[i];
+    unsigned char t = c;  // transformed symbol
+
+    if (op == STAGE_FORWARD) {
+      if (at_sentence_start(s) && (is_upper(c) || is_lower(c))) {
+        t = is_upper(c) ? c + 32 : c;
+        hist[s->hist_len] = (char)t;
+        io->flag(io->host, is_upper(c) ? 1 : 0, hist, s->hist_len, s->hist_len + 1, 1);
+      }
+      io->out(io->host, (const char*)&t, 1);
+    } else {
+      unsigned char o = c;  // restored symbol
+      if (at_sentence_start(s) && is_lower(c)) {
+        hist[s->hist_len] = (char)c;
+        int f = io->getflag(io->host, hist, s->hist_len, s->hist_len + 1, 1);
+        if (f == 1) o = c - 32;
+      }
+      io->out(io->host, (const char*)&o, 1);
+      c = o;
+    }
+
+    hist_push(s, (char)t);
+    s->prev2 = s->prev1;
+    s->prev1 = c;
+  }
+
+  return (int)io->in_len;
+}
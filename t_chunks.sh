@@ -0,0 +1,22 @@
+#!/bin/sh
+# repl2l chunk regression: an lb/la that looks past one byte, here a
+# lookahead across the line end, must keep the input in one chunk, so that
+# every thread count gives the output of one pass over the whole file
+# usage: ./t_chunks.sh [repl2l]
+R=${1:-./repl2l}
+T=${TMPDIR:-/tmp}/t_chunks.$$
+mkdir -p $T || exit 1
+trap 'rm -rf $T' EXIT
+
+# 11 MB, so that -t 4 cuts it into chunks; every "the" but the last one is
+# followed by a line starting with T
+awk 'BEGIN { for (i = 0; i < 600000; i++) printf "Tx line %d the\n", i }' > $T/in
+printf ' \n(?=\\nT)\nthe\tteh\n' > $T/la.cfg
+
+fail=0
+$R -t 1 c $T/la.cfg $T/in $T/out1 2> $T/log1 && $R -t 4 c $T/la.cfg $T/in $T/out4 2> $T/log4 || fail=1
+cmp -s $T/out1 $T/out4 || { echo "FAIL -t 4 output differs from -t 1"; fail=1; }
+[ "$(grep -c teh $T/out4)" = 599999 ] || { echo "FAIL expected 599999 replacements"; fail=1; }
+$R -t 4 d $T/la.cfg $T/out4 $T/rst 2> $T/logd && cmp -s $T/rst $T/in || { echo "FAIL round trip"; fail=1; }
+[ $fail = 0 ] && echo "OK chunks"
+exit $fail
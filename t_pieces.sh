@@ -0,0 +1,29 @@
+#!/bin/sh
+# repl2 piece table regression: a forward scan over replacement text that
+# a config before it wrote (a piece of store.added longer than the scan
+# margin, scanned in place) while its own replacements grow that text
+# usage: ./t_pieces.sh [repl2]
+R=$(cd "$(dirname "${1:-./repl2}")" && pwd)/$(basename "${1:-./repl2}")
+T=${TMPDIR:-/tmp}/t_pieces.$$
+mkdir -p $T || exit 1
+trap 'rm -rf $T' EXIT
+cp default.dll $T/ || exit 1
+cd $T
+
+# c1 turns every " x" into 46 a's, c2 every a into 20 b's
+A=$(awk 'BEGIN { for (i = 0; i < 46; i++) printf "a" }')
+B=$(awk 'BEGIN { for (i = 0; i < 20; i++) printf "b" }')
+printf '[^a-z]\n[^a-z]\nx\t%s\n' $A > c1.cfg
+printf '(?:)\n(?:)\na\t%s\n' $B > c2.cfg
+printf './c1.cfg\n./c2.cfg\n' > l
+awk 'BEGIN { for (i = 0; i < 50000; i++) printf " x" }' > in
+awk -v b=$B 'BEGIN { for (i = 1; i < 50000; i++) { printf " "; for (k = 0; k < 46; k++) printf "%s", b } printf " x" }' > expect
+
+fail=0
+for opt in -S ""; do
+  $R $opt c @l in out flg 2> log_c && $R $opt d @l out rst flg 2> log_d || { echo "FAIL repl2 $opt"; fail=1; continue; }
+  cmp -s out expect || { echo "FAIL $opt output"; fail=1; }
+  cmp -s rst in || { echo "FAIL $opt round trip"; fail=1; }
+done
+[ $fail = 0 ] && echo "OK pieces"
+exit $fail